@@ -0,0 +1,277 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#if defined HAVE_CONFIG_H
+#   include "config.h"
+#endif
+
+#include <string.h>
+
+#include <SDL.h>
+
+#include "common.h"
+
+#include "capture.h"
+#include "pcxread.h"
+#include "dprint.h"
+
+// The game thread fills slot_in and the writer thread drains slot_out.
+// The two semaphores count the free and filled slots, so each index is
+// only ever touched by one thread and the game thread never has to wait
+// for the disk: when the ring is full the frame is dropped and counted.
+#define CAPTURE_SLOTS 8
+
+struct capture_slot
+{
+    uint8_t *pixels;
+    int alloc;
+    ivec2 size;                    // 0 x 0 tells the writer to quit
+    uint8_t rgb[256 * 3];
+    char filename[256];            // empty for frames of the stream
+};
+
+static capture_slot slots[CAPTURE_SLOTS];
+static int slot_in = 0, slot_out = 0;
+static SDL_sem *free_slots = NULL, *full_slots = NULL;
+static SDL_Thread *writer = NULL;
+
+static FILE *stream = NULL;
+static int stream_y4m = 0;
+static ivec2 stream_size(0);
+static int frames_written = 0, frames_dropped = 0;
+
+static void write_frame(capture_slot *s)
+{
+    static uint8_t *buf = NULL;
+    static int buf_size = 0;
+
+    ivec2 size = s->size;
+    if (!stream_size.x)
+    {
+        stream_size = size;
+        if (stream_y4m)
+            fprintf(stream, "YUV4MPEG2 W%d H%d F15:1 Ip A1:1 C420jpeg\n",
+                    size.x, size.y);
+    }
+    else if (size != stream_size)
+    {
+        // The stream cannot change resolution halfway
+        frames_dropped++;
+        return;
+    }
+
+    int cw = (size.x + 1) / 2, ch = (size.y + 1) / 2;
+    int need = stream_y4m ? size.x * size.y + 2 * cw * ch : size.x * 3;
+    if (need > buf_size)
+    {
+        buf_size = need;
+        buf = (uint8_t *)realloc(buf, buf_size);
+    }
+
+    if (!stream_y4m)
+    {
+        for (int y = 0; y < size.y; y++)
+        {
+            uint8_t const *sl = s->pixels + y * size.x;
+            uint8_t *dst = buf;
+            for (int x = 0; x < size.x; x++, dst += 3)
+                memcpy(dst, s->rgb + sl[x] * 3, 3);
+            fwrite(buf, 1, size.x * 3, stream);
+        }
+        frames_written++;
+        return;
+    }
+
+    // Full range BT.601, as expected by C420jpeg
+    uint8_t ytab[256], utab[256], vtab[256];
+    for (int i = 0; i < 256; i++)
+    {
+        int r = s->rgb[i * 3], g = s->rgb[i * 3 + 1], b = s->rgb[i * 3 + 2];
+        ytab[i] = (77 * r + 150 * g + 29 * b + 128) >> 8;
+        utab[i] = Min(255, (-43 * r - 85 * g + 128 * b + 32896) >> 8);
+        vtab[i] = Min(255, (128 * r - 107 * g - 21 * b + 32896) >> 8);
+    }
+
+    uint8_t *yp = buf, *up = buf + size.x * size.y, *vp = up + cw * ch;
+    for (int i = 0; i < size.x * size.y; i++)
+        yp[i] = ytab[s->pixels[i]];
+
+    for (int y = 0; y < ch; y++)
+    {
+        uint8_t const *sl0 = s->pixels + 2 * y * size.x;
+        uint8_t const *sl1 = 2 * y + 1 < size.y ? sl0 + size.x : sl0;
+        for (int x = 0; x < cw; x++)
+        {
+            int x0 = 2 * x, x1 = Min(2 * x + 1, size.x - 1);
+            up[y * cw + x] = (utab[sl0[x0]] + utab[sl0[x1]]
+                               + utab[sl1[x0]] + utab[sl1[x1]] + 2) >> 2;
+            vp[y * cw + x] = (vtab[sl0[x0]] + vtab[sl0[x1]]
+                               + vtab[sl1[x0]] + vtab[sl1[x1]] + 2) >> 2;
+        }
+    }
+
+    fputs("FRAME\n", stream);
+    fwrite(buf, 1, need, stream);
+    frames_written++;
+}
+
+static void write_slot(capture_slot *s)
+{
+    if (s->filename[0])
+        write_PCX(s->pixels, s->size, s->rgb, s->filename);
+    else if (stream)
+        write_frame(s);
+}
+
+static int capture_thread(void *arg)
+{
+    (void)arg;
+
+    for (;;)
+    {
+        SDL_SemWait(full_slots);
+        capture_slot *s = slots + slot_out;
+        slot_out = (slot_out + 1) % CAPTURE_SLOTS;
+
+        int quit = !s->size.x;
+        if (!quit)
+            write_slot(s);
+        SDL_SemPost(free_slots);
+        if (quit)
+            break;
+    }
+
+    return 0;
+}
+
+// Returns NULL when the frame has to be dropped. Without thread support
+// the single spare slot is handed out and written right away by put_slot.
+static capture_slot *get_slot(ivec2 size, int wait)
+{
+    static capture_slot spare;
+    capture_slot *s = &spare;
+
+    if (!writer && !free_slots)
+    {
+        free_slots = SDL_CreateSemaphore(CAPTURE_SLOTS);
+        full_slots = SDL_CreateSemaphore(0);
+        if (free_slots && full_slots)
+            writer = SDL_CreateThread(capture_thread, NULL);
+        if (!writer)
+            dprintf("capture: no thread support, frames are written "
+                    "synchronously\n");
+    }
+
+    if (writer)
+    {
+        if (wait)
+            SDL_SemWait(free_slots);
+        else if (SDL_SemTryWait(free_slots))
+        {
+            frames_dropped++;
+            return NULL;
+        }
+        s = slots + slot_in;
+        slot_in = (slot_in + 1) % CAPTURE_SLOTS;
+    }
+
+    if (size.x * size.y > s->alloc)
+    {
+        s->alloc = size.x * size.y;
+        s->pixels = (uint8_t *)realloc(s->pixels, s->alloc);
+    }
+    s->size = size;
+    s->filename[0] = 0;
+    return s;
+}
+
+static void put_slot(capture_slot *s)
+{
+    if (writer)
+        SDL_SemPost(full_slots);
+    else
+        write_slot(s);
+}
+
+static void copy_screen(capture_slot *s, image *screen, palette *pal)
+{
+    memcpy(s->pixels, screen->scan_line(0), s->size.x * s->size.y);
+    memcpy(s->rgb, pal->addr(), 256 * 3);
+}
+
+void capture_start(char const *filename)
+{
+    if (stream)
+        return;
+
+    stream = fopen(filename, "wb");
+    if (!stream)
+    {
+        dprintf("capture: unable to open %s for writing\n", filename);
+        return;
+    }
+
+    int len = strlen(filename);
+    stream_y4m = len > 4 && !strcmp(filename + len - 4, ".y4m");
+    stream_size = ivec2(0);
+    frames_written = frames_dropped = 0;
+}
+
+void capture_stop()
+{
+    if (writer)
+    {
+        capture_slot *s = get_slot(ivec2(0), 1);
+        put_slot(s);
+        SDL_WaitThread(writer, NULL);
+        writer = NULL;
+    }
+    if (free_slots)
+    {
+        SDL_DestroySemaphore(free_slots);
+        SDL_DestroySemaphore(full_slots);
+        free_slots = full_slots = NULL;
+    }
+    slot_in = slot_out = 0;
+
+    if (stream)
+    {
+        fclose(stream);
+        stream = NULL;
+        dprintf("capture: %d frames written, %d dropped\n",
+                frames_written, frames_dropped);
+    }
+}
+
+int capture_on()
+{
+    return stream != NULL;
+}
+
+void capture_frame(image *screen, palette *pal)
+{
+    if (!stream || !pal)
+        return;
+
+    capture_slot *s = get_slot(screen->Size(), 0);
+    if (!s)
+        return;
+    copy_screen(s, screen, pal);
+    put_slot(s);
+}
+
+void capture_pcx(image *screen, palette *pal, char const *filename)
+{
+    capture_slot *s = get_slot(screen->Size(), 1);
+    copy_screen(s, screen, pal);
+    strncpy(s->filename, filename, sizeof(s->filename) - 1);
+    s->filename[sizeof(s->filename) - 1] = 0;
+    put_slot(s);
+}
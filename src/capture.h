@@ -0,0 +1,28 @@
+/*
+ *  Abuse - dark 2D side-scrolling platform game
+ *  Copyright (c) 1995 Crack dot Com
+ *  Copyright (c) 2005-2011 Sam Hocevar <sam@hocevar.net>
+ *
+ *  This software was released into the Public Domain. As with most public
+ *  domain software, no warranty is made or implied by Crack dot Com, by
+ *  Jonathan Clark, or by Sam Hocevar.
+ */
+
+#ifndef __CAPTURE_HPP_
+#define __CAPTURE_HPP_
+
+#include "image.h"
+#include "palette.h"
+
+// Frames are copied into a ring buffer on the game thread and written out
+// by a background thread, so recording does not change the frame timing.
+// Names ending in .y4m get a YUV4MPEG2 stream, anything else raw RGB24.
+void capture_start(char const *filename);
+void capture_stop();
+int capture_on();
+
+void capture_frame(image *screen, palette *pal);
+// Queue a single PCX screenshot for the background thread
+void capture_pcx(image *screen, palette *pal, char const *filename);
+
+#endif
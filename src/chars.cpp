@@ -81,6 +81,45 @@ char const *ofun_names[TOTAL_OFUNS] =
     "type_change_fun"
 };
 
+// Symbol name -> slot tables (-1 = empty), rebuilt whenever they get more
+// than half full so lookups stay short
+static void hash_insert(short *table, int size, char const *name, int index)
+{
+    int i = var_name_hash(name) & (size - 1);
+    while (table[i] >= 0)
+        i = (i + 1) & (size - 1);
+    table[i] = index;
+}
+
+static void hash_add(short *&table, uint16_t &size, int used,
+                     LSymbol **syms, int total, int index, int rebuild = 0)
+{
+    if (rebuild || used * 2 > size)
+    {
+        while (used * 2 > size)
+            size = size ? size * 2 : 16;
+        table = (short *)realloc(table, sizeof(short) * size);
+        memset(table, 0xff, sizeof(short) * size);
+        for (int i = 0; i < total; i++)
+            if (syms[i] && i != index)
+                hash_insert(table, size, lstring_value(syms[i]->GetName()), i);
+    }
+    hash_insert(table, size, lstring_value(syms[index]->GetName()), index);
+}
+
+static int hash_find(short const *table, int size, LSymbol **syms,
+                     char const *name)
+{
+    if (!size)
+        return -1;
+
+    int i = var_name_hash(name) & (size - 1);
+    for (; table[i] >= 0; i = (i + 1) & (size - 1))
+        if (!strcmp(lstring_value(syms[table[i]]->GetName()), name))
+            return table[i];
+    return -1;
+}
+
 int CharacterType::add_state(LObject *symbol) // returns index into seq to use
 {
     if (item_type(symbol) != L_SYMBOL)
@@ -134,7 +173,13 @@ int CharacterType::add_state(LObject *symbol) // returns index into seq to use
         ts = num + 1;
     }
 
-    seq_syms[num] = (LSymbol *)symbol;
+    if (seq_syms[num] != symbol)
+    {
+        // a different symbol may already own this slot, drop its entry
+        int rebuild = seq_syms[num] != NULL;
+        seq_syms[num] = (LSymbol *)symbol;
+        hash_add(state_hash, state_hash_size, ts, seq_syms, ts, num, rebuild);
+    }
     return num;
 }
 
@@ -197,6 +242,17 @@ void l_obj_print(long number)  // exten lisp function switches on number
   dprintf("%d",current_object->lvars[t->var_index[number]]);
 }
 
+int CharacterType::find_var(char const *name)
+{
+    return hash_find(var_hash, var_hash_size, vars, name);
+}
+
+int CharacterType::find_state(char const *name)
+{
+    int i = hash_find(state_hash, state_hash_size, seq_syms, name);
+    return i >= 0 && seq[i] ? i : -1;
+}
+
 void CharacterType::add_var(void *symbol, void *name)
 {
   /* First see if the variable has been defined for another object
@@ -231,6 +287,7 @@ void CharacterType::add_var(void *symbol, void *name)
     var_index[index]=tv;
     vars[index]=(LSymbol *)symbol;
     tv++;
+    hash_add(var_hash, var_hash_size, tv, vars, tiv, index);
       }
     } else
     {
@@ -244,6 +301,7 @@ void CharacterType::add_var(void *symbol, void *name)
       var_index[index]=tv;
       vars[index]=(LSymbol *)symbol;
       tv++;
+      hash_add(var_hash, var_hash_size, tv, vars, tiv, index);
     }
   } else  /** Nope, looks like we have to add the variable ourself and define the assesor funs */
   {
@@ -270,6 +328,7 @@ void CharacterType::add_var(void *symbol, void *name)
     vars[free_index]=(LSymbol *)symbol;
     var_index[free_index]=tv;
     tv++;
+    hash_add(var_hash, var_hash_size, tv, vars, tiv, free_index);
     LSpace::Current=sp;
   }
 }
@@ -277,13 +336,7 @@ void CharacterType::add_var(void *symbol, void *name)
 
 long CharacterType::isa_var_name(char *name)
 {
-  for (int i=0; i<TOTAL_OBJECT_VARS; i++)
-    if (!strcmp(object_descriptions[i].name,name))
-      return 1;
-  for (int i=0; i<tiv; i++)
-    if (!strcmp(lstring_value(((LSymbol *)vars[i])->GetName()),name))
-      return 1;
-  return 0;
+  return simple_object::var_number(name) >= 0 || find_var(name) >= 0;
 }
 
 CharacterType::CharacterType(LList *args, LSymbol *name)
@@ -294,6 +347,10 @@ CharacterType::CharacterType(LList *args, LSymbol *name)
     seq_syms=NULL;
     vars=NULL;
     var_index=NULL;
+    var_hash=NULL;
+    var_hash_size=0;
+    state_hash=NULL;
+    state_hash_size=0;
     tiv=0;
 
     LSymbol *l_abil =   LSymbol::FindOrCreate("abilities");
@@ -568,5 +625,7 @@ CharacterType::~CharacterType()
         free(vars);
         free(var_index);
     }
+    free(var_hash);
+    free(state_hash);
 }
 
@@ -92,11 +92,17 @@ public:
   uint16_t ts,tiv,tv; // total states, total index vars, total local vars
   sequence **seq;   // [0..ts-1]
   LSymbol **seq_syms;  // symbol describing what this state is [0..ts-1]
+  short *state_hash;   // open addressed name -> seq index, -1 = empty
+  uint16_t state_hash_size;
 
   LSymbol **vars;  // symbol describing variable names    [0..tiv-1]
   short *var_index; // index into local var                [0..tiv-1]
+  short *var_hash;  // open addressed name -> vars index, -1 = empty
+  uint16_t var_hash_size;
 
   void add_var(void *symbol, void *name);
+  int find_var(char const *name);           // returns index into vars or -1
+  int find_state(char const *name);         // returns index into seq or -1
   int add_state(LObject *symbol);           // returns index into seq to use
   int abil[TOTAL_ABILITIES];
   void *fun_table[TOTAL_OFUNS];             // pointers to lisp function for this object
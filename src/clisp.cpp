@@ -782,7 +782,7 @@ void *l_caller(long number, void *args)
     figures=(CharacterType **)realloc(figures,sizeof(CharacterType *)*(total_objects+1));
       }
 
-      object_names[total_objects] = strdup(lstring_value(sym->GetName()));
+      add_object_name(total_objects, lstring_value(sym->GetName()));
       figures[total_objects]=new CharacterType((LList *)CDR(args),sym);
       total_objects++;
       return LNumber::Create(total_objects-1);
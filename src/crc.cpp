@@ -25,6 +25,27 @@ uint16_t calc_crc(void *buf, size_t len)
     return (c2 << 8) | c1;
 }
 
+uint32_t calc_crc32(void const *buf, size_t len)
+{
+    static uint32_t table[256];
+    if (!table[1])
+        for (uint32_t i = 0; i < 256; i++)
+        {
+            uint32_t c = i;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            table[i] = c;
+        }
+
+    uint8_t const *data = (uint8_t const *)buf;
+    uint32_t crc = 0xffffffff;
+
+    while (len--)
+        crc = table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+    return crc ^ 0xffffffff;
+}
+
 
 
 uint32_t crc_file(bFILE *fp)
@@ -14,6 +14,7 @@
 #include "specs.h"
 
 uint16_t calc_crc(void *buf, size_t len);
+uint32_t calc_crc32(void const *buf, size_t len); // standard CRC-32
 uint32_t crc_file(bFILE *fp);
 
 #endif
@@ -107,8 +107,7 @@ void demo_manager::do_inputs()
         if (p->local_player())
           p->get_input();
 
-      base->packet.write_uint8(SCMD_SYNC);
-      base->packet.write_uint16(make_sync());
+      write_sync(&base->packet);
       demo_man.save_packet(base->packet.packet_data(),base->packet.packet_size());
       process_packet_commands(base->packet.packet_data(),base->packet.packet_size());
 
@@ -31,6 +31,7 @@
 #include "tools.h"
 #include "game.h"
 #include "pcxread.h"
+#include "capture.h"
 #include "lisp_gc.h"
 #include "demo.h"
 #include "profile.h"
@@ -1634,12 +1635,12 @@ void dev_controll::handle_event(Event &ev)
     return;
 
   if (ev.type==EV_KEY && ev.key==JK_F2)
-    write_PCX(main_screen,pal,"scrnshot.pcx");
+    capture_pcx(main_screen,pal,"scrnshot.pcx");
   else if (ev.type==EV_KEY && ev.key==JK_F3)
   {
     char name[100];
     sprintf(name,"shot%04d.pcx",screen_shot_on++);
-    write_PCX(main_screen,pal,name);
+    capture_pcx(main_screen,pal,name);
   } else if (ev.type==EV_KEY && ev.key==JK_F5)
   {
     if (sshot_fcount!=-1)
@@ -3253,7 +3254,7 @@ void dev_controll::fg_fill(int color, int x, int y, pal_win *p)
 
       do
       {
-        sl[x]=get_color(color,x-startx,y-starty,p);
+        current_level->PutFg(ivec2(x, y), get_color(color,x-startx,y-starty,p));
         if (y>0)
         { above=current_level->get_fgline(y-1);
           if (x>0 && fgvalue(above[x-1])!=fgvalue(fcolor) && fgvalue(above[x])==fgvalue(fcolor))
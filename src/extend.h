@@ -50,6 +50,7 @@ public:
   morph_char *mc;
   int total_vars();
   char const *var_name(int x);
+  static int var_number(char const *name);  // -1 if not a builtin var
   int var_type(int x);
   void set_var(int x, uint32_t v);
   int32_t get_var(int x);
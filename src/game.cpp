@@ -58,6 +58,7 @@
 #include "chat.h"
 #include "demo.h"
 #include "netcfg.h"
+#include "capture.h"
 
 #define SHIFT_RIGHT_DEFAULT 0
 #define SHIFT_DOWN_DEFAULT 30
@@ -190,7 +191,7 @@ void Game::play_sound(int id, int vol, int32_t x, int32_t y)
 
     int v = (400 - mindist) * sfx_volume / 400 - (127 - vol);
     if(v > 0)
-        cache.sfx(id)->play(v, 128, p);
+        sound_queue(cache.sfx(id), v, p, x, y);
 }
 
 int get_option(char const *name)
@@ -552,6 +553,7 @@ void Game::end_session()
 }
 
 int need_delay = 1;
+static int frame_cap = 60;
 
 void Game::dev_scroll()
 {
@@ -645,7 +647,25 @@ static void post_render()
   }
 }
 
-void Game::draw_map(view *v, int interpolate)
+// Visible foreground tiles, collected by one sweep of the map in draw_map()
+// and split into the ones drawn under and over the objects
+struct fg_draw
+{
+  TransImage *im;
+  int16_t x, y;    // map position, to mark it as seen
+  ivec2 pos;       // screen position
+};
+
+static fg_draw *fg_under = NULL, *fg_over = NULL;
+static int fg_list_size = 0;
+
+// While draw_split_views() runs, draw_map() leaves the lighting and what
+// is drawn over it to be done for all views at once
+static light_job *split_jobs = NULL;
+static view **split_views = NULL;
+static int split_total = -1, split_size = 0;
+
+void Game::draw_map(view *v, int alpha)
 {
   backtile *bt;
   int x1, y1, x2, y2, x, y, xo, yo, nxoff, nyoff;
@@ -708,10 +728,10 @@ void Game::draw_map(view *v, int interpolate)
 
 
   int32_t xoff, yoff;
-  if(interpolate)
+  if(alpha < 256)
   {
-    xoff = v->interpolated_xoff();
-    yoff = v->interpolated_yoff();
+    xoff = v->interpolated_xoff(alpha);
+    yoff = v->interpolated_yoff(alpha);
   } else
   {
     xoff = v->xoff();
@@ -746,35 +766,70 @@ void Game::draw_map(view *v, int interpolate)
     xinc = btile_width();
     yinc = btile_height();
 
+    // bring the view's background cache up to date, only cells that were
+    // scrolled in or whose tile was changed get drawn again
+    ivec2 vsize = v->m_bb - v->m_aa + ivec2(1);
+    int cols = vsize.x / xinc + 2, rows = vsize.y / yinc + 2;
+    ivec2 csize(cols * xinc, rows * yinc);
+    if(!v->m_bg_cache || v->m_bg_cache->Size() != csize)
+    {
+      delete v->m_bg_cache;
+      v->m_bg_cache = new image(csize);
+      v->m_bg_cells = (bg_cell *)realloc(v->m_bg_cells, sizeof(bg_cell) * cols * rows);
+      for(int i = 0; i < cols * rows; i++)
+        v->m_bg_cells[i].x = -1;
+    }
+
     int bh = current_level->background_height(), bw = current_level->background_width();
     uint16_t *bl;
-    for(draw_y = yo, y = y1; y <= y2; y++, draw_y += yinc)
+    for(y = y1; y <= y2; y++)
     {
       if(y >= bh)
         bl = NULL;
       else
         bl = current_level->get_bgline(y)+x1;
 
-      for(x = x1, draw_x = xo; x <= x2; x++, draw_x += xinc)
+      bg_cell *row = v->m_bg_cells + (y % rows) * cols;
+      for(x = x1; x <= x2; x++)
       {
-    if(x < bw && y < bh)
-    {
-          bt = get_bg(*bl);
-      bl++;
-    }
-    else bt = get_bg(0);
+        uint16_t tile = 0;
+        if(x < bw && y < bh)
+        {
+          tile = *bl;
+          bl++;
+        }
 
-        main_screen->PutImage(bt->im, ivec2(draw_x, draw_y));
-//        if(!(dev & EDIT_MODE) && bt->next)
-//      current_level->put_bg(x, y, bt->next);
+        bg_cell *c = row + x % cols;
+        if(c->x != x || c->y != y || c->tile != tile)
+        {
+          bt = get_bg(tile);
+          v->m_bg_cache->PutImage(bt->im, ivec2(x % cols * xinc, y % rows * yinc));
+          c->x = x;
+          c->y = y;
+          c->tile = tile;
+        }
       }
     }
+
+    // copy it out, in up to four pieces where the visible area wraps
+    ivec2 src(nxoff % csize.x, nyoff % csize.y);
+    ivec2 part = Min(vsize, csize - src);
+    main_screen->PutPart(v->m_bg_cache, v->m_aa, src, src + part);
+    if(part.x < vsize.x)
+      main_screen->PutPart(v->m_bg_cache, v->m_aa + ivec2(part.x, 0),
+                           ivec2(0, src.y), ivec2(vsize.x - part.x, src.y + part.y));
+    if(part.y < vsize.y)
+      main_screen->PutPart(v->m_bg_cache, v->m_aa + ivec2(0, part.y),
+                           ivec2(src.x, 0), ivec2(src.x + part.x, vsize.y - part.y));
+    if(part.x < vsize.x && part.y < vsize.y)
+      main_screen->PutPart(v->m_bg_cache, v->m_aa + part,
+                           ivec2(0), vsize - part);
   }
 
 //  if(!(dev & EDIT_MODE))
 //    server_check();
 
-  uint8_t rescan = 0;
+  int total_over = 0;
 
     int fw, fh;
 
@@ -823,86 +878,67 @@ void Game::draw_map(view *v, int interpolate)
 
   if(dev & DRAW_FG_LAYER)
   {
-    ivec2 ncaa, ncbb;
-    main_screen->GetClip(ncaa, ncbb);
-
-    int scr_w = main_screen->Size().x;
     if(dev & MAP_MODE)
     {
       if(dev & EDIT_MODE)
         main_screen->clear(wm->bright_color());
       else
         main_screen->clear(wm->black());
-      main_screen->Lock();
-      for(y = y1, draw_y = yo; y <= y2; y++, draw_y += yinc)
-      {
-    if (!(draw_y < ncaa.y || draw_y + yinc > ncbb.y))
-    {
-      uint16_t *cl = current_level->get_fgline(y)+x1;
-      uint8_t *sl1 = main_screen->scan_line(draw_y)+xo;
-      for(x = x1, draw_x = xo; x <= x2; x++, cl++, sl1 += xinc, draw_x += xinc)
-      {
-        if(!(draw_x < ncaa.x || draw_x + xinc > ncbb.x))
-        {
-          int fort_num;
-//          if(*cl & 0x8000 || (dev & EDIT_MODE))
-            fort_num = fgvalue(*cl);
-//          else fort_num = 0;
-
-          uint8_t *sl2 = get_fg(fort_num)->micro_image->scan_line(0);
-          uint8_t *sl3 = sl1;
-          memcpy(sl3, sl2, AUTOTILE_WIDTH); sl2 += AUTOTILE_WIDTH; sl3 += scr_w;
-          memcpy(sl3, sl2, AUTOTILE_WIDTH); sl2 += AUTOTILE_WIDTH; sl3 += scr_w;
-          memcpy(sl3, sl2, AUTOTILE_WIDTH);
-        }
-      }
-    }
-      }
-      main_screen->Unlock();
+      // the level keeps the whole map at this scale, copy the visible part
+      if(x1 <= x2 && y1 <= y2)
+        main_screen->PutPart(current_level->get_map_image(), ivec2(xo, yo),
+                             ivec2(x1 * xinc, y1 * yinc),
+                             ivec2((x2 + 1) * xinc, (y2 + 1) * yinc));
 
       if(dev & EDIT_MODE)
         current_level->draw_areas(v);
     } else
     {
+      // x2 and y2 were clamped to the map size above
+      int need = Max(0, (x2 - x1 + 1) * (y2 - y1 + 1));
+      if(need > fg_list_size)
+      {
+        fg_list_size = need;
+        fg_under = (fg_draw *)realloc(fg_under, sizeof(fg_draw) * need);
+        fg_over = (fg_draw *)realloc(fg_over, sizeof(fg_draw) * need);
+      }
 
-      int fg_h = current_level->foreground_height(), fg_w = current_level->foreground_width();
-
+      int total_under = 0;
       for(y = y1, draw_y = yo; y <= y2; y++, draw_y += yinc)
       {
-
-    uint16_t *cl;
-    if(y < fg_h)
-      cl = current_level->get_fgline(y)+x1;
-    else cl = NULL;
-
+    uint16_t *cl = current_level->get_fgline(y)+x1;
     for(x = x1, draw_x = xo; x <= x2; x++, draw_x += xinc, cl++)
     {
-      if(x < fg_w && y < fg_h)
-      {
-        if(above_tile(*cl))
-        rescan = 1;
-        else
-        {
-          int fort_num = fgvalue(*cl);
-          if(fort_num != BLACK)
-          {
-            get_fg(fort_num)->im->PutImage(main_screen, ivec2(draw_x, draw_y));
+      int fort_num = fgvalue(*cl);
+      if(fort_num == BLACK)
+        continue;
 
+      fg_draw *d;
+      if(above_tile(*cl))
+        d = fg_over + total_over++;
+      else
+      {
+        d = fg_under + total_under++;
         if(!(dev & EDIT_MODE))
-            *cl|=0x8000;      // mark as has - been - seen
-          }
-        }
+          *cl|=0x8000;      // mark as has - been - seen
       }
+      d->im = get_fg(fort_num)->im;
+      d->x = x;
+      d->y = y;
+      d->pos = ivec2(draw_x, draw_y);
     }
       }
+
+      for(int i = 0; i < total_under; i++)
+        fg_under[i].im->PutImage(main_screen, fg_under[i].pos);
     }
   }
 
   int32_t ro = rand_on;
   if(dev & DRAW_PEOPLE_LAYER)
   {
-    if(interpolate)
-      current_level->interpolate_draw_objects(v);
+    if(alpha < 256)
+      current_level->interpolate_draw_objects(v, alpha);
     else
       current_level->draw_objects(v);
   }
@@ -915,32 +951,22 @@ void Game::draw_map(view *v, int interpolate)
 
     draw_panims(v);
 
-    if(dev & DRAW_FG_LAYER && rescan)
+    if(dev & DRAW_FG_LAYER)
     {
-      for(y = y1, draw_y = yo; y <= y2; y++, draw_y += yinc)
+      for(int i = 0; i < total_over; i++)
       {
-    uint16_t *cl = current_level->get_fgline(y)+x1;
-    for(x = x1, draw_x = xo; x <= x2; x++, draw_x += xinc, cl++)
+    fg_draw *d = fg_over + i;
+    if(dev & DRAW_BG_LAYER)
+      d->im->PutImage(main_screen, d->pos);
+    else
+      d->im->PutFilled(main_screen, d->pos, 0);
+
+    if(!(dev & EDIT_MODE))
+      current_level->mark_seen(d->x, d->y);
+    else
     {
-      if(above_tile(*cl))
-      {
-        int fort_num = fgvalue(*cl);
-        if(fort_num != BLACK)
-        {
-          if(dev & DRAW_BG_LAYER)
-          get_fg(fort_num)->im->PutImage(main_screen, ivec2(draw_x, draw_y));
-          else
-          get_fg(fort_num)->im->PutFilled(main_screen, ivec2(draw_x, draw_y), 0);
-
-          if(!(dev & EDIT_MODE))
-          current_level->mark_seen(x, y);
-          else
-          {
-        main_screen->Line(ivec2(draw_x, draw_y), ivec2(draw_x + xinc, draw_y + yinc), wm->bright_color());
-        main_screen->Line(ivec2(draw_x + xinc, draw_y), ivec2(draw_x, draw_y + yinc), wm->bright_color());
-          }
-        }
-      }
+      main_screen->Line(d->pos, d->pos + ivec2(xinc, yinc), wm->bright_color());
+      main_screen->Line(d->pos + ivec2(xinc, 0), d->pos + ivec2(0, yinc), wm->bright_color());
     }
       }
     }
@@ -1002,7 +1028,8 @@ void Game::draw_map(view *v, int interpolate)
     wm->font()->PutString(main_screen, aa + ivec2(5), help_text, color);
     if(color > 30)
         help_text_frames = -1;
-    else help_text_frames++;
+    else if(alpha == 256)
+        help_text_frames++;
 
       }
     }
@@ -1024,9 +1051,20 @@ void Game::draw_map(view *v, int interpolate)
       } else
       {
     main_screen->dirt_on();
-    if(xres * yres <= 64000)
-          light_screen(main_screen, xoff, yoff, white_light, v->ambient);
-    else light_screen(main_screen, xoff, yoff, white_light, 63);            // no lighting for hi - rez
+    if(split_total >= 0)
+    {
+      light_job *j = split_jobs + split_total;
+      j->aa = v->m_aa;
+      j->bb = v->m_bb + ivec2(1);
+      j->screenx = xoff;
+      j->screeny = yoff;
+      j->ambient = v->ambient;
+      split_views[split_total++] = v;
+      rand_on = ro;
+      main_screen->SetClip(caa, cbb);
+      return;
+    }
+    light_screen(main_screen, xoff, yoff, white_light, v->ambient);
       }
 
     } else
@@ -1044,7 +1082,11 @@ void Game::draw_map(view *v, int interpolate)
 
   main_screen->SetClip(caa, cbb);
 
+  draw_map_overlay(v);
+}
 
+void Game::draw_map_overlay(view *v)
+{
   if(playing_state(state))        // draw stuff outside the clipping region
     v->draw_character_damage();
 
@@ -1054,6 +1096,43 @@ void Game::draw_map(view *v, int interpolate)
   sbar.draw_update();
 }
 
+// Draw several split screen views, lighting them all at once with one
+// thread per view. Everything else still runs here, in view order, since
+// object draw functions share the Lisp interpreter, current_view and
+// current_vxadd.
+void Game::draw_split_views(int alpha)
+{
+  int total = 0;
+  for(view *f = first_view; f; f = f->next)
+    total++;
+  if(total > split_size)
+  {
+    split_size = total;
+    split_jobs = (light_job *)realloc(split_jobs, sizeof(light_job) * total);
+    split_views = (view **)realloc(split_views, sizeof(view *) * total);
+  }
+
+  split_total = 0;
+  for(view *f = first_view; f; f = f->next)
+    if(f->drawable())
+      draw_map(f, alpha);
+
+  int lit = split_total;
+  split_total = -1;
+  light_screens(main_screen, split_jobs, lit, white_light);
+
+  ivec2 caa, cbb;
+  main_screen->GetClip(caa, cbb);
+  for(int i = 0; i < lit; i++)
+  {
+    view *v = split_views[i];
+    main_screen->SetClip(v->m_aa, v->m_bb + ivec2(1));
+    post_render();
+    main_screen->SetClip(caa, cbb);
+    draw_map_overlay(v);
+  }
+}
+
 void Game::PutFg(ivec2 pos, int type)
 {
     if (current_level->GetFg(pos) == type)
@@ -1284,6 +1363,17 @@ Game::Game(int argc, char **argv)
       no_delay = 1;
       dprintf("Frame delay off (-nodelay)\n");
     }
+    else if(!strcmp(argv[i], "-sync_interval") && i + 1 < argc)
+    {
+      i++;
+      if(atoi(argv[i]) >= 0)
+        sync_interval = atoi(argv[i]);
+    }
+    else if(!strcmp(argv[i], "-frame_cap") && i + 1 < argc)
+    {
+      i++;
+      frame_cap = Max(0, atoi(argv[i]));
+    }
 
 
   image_init();
@@ -1454,7 +1544,7 @@ void Game::show_time()
     console_font->PutString(main_screen, first_view->m_aa + ivec2(0, 10), str);
 }
 
-void Game::update_screen()
+void Game::update_screen(int alpha)
 {
   if(state == HELP_STATE)
     draw_help();
@@ -1479,16 +1569,23 @@ void Game::update_screen()
     }
       }
 
+      int drawable = 0;
       for(f = first_view; f; f = f->next)
+        drawable += f->drawable() ? 1 : 0;
+
+      if(drawable > 1 && !interpolate_draw && !small_render
+          && (dev & DRAW_LIGHTS) && !(dev & MAP_MODE))
+        draw_split_views(alpha);
+      else for(f = first_view; f; f = f->next)
       {
         if(f->drawable())
     {
-      if(interpolate_draw)
+      if(interpolate_draw && alpha == 256)
       {
-            draw_map(f, 1);
+            draw_map(f, 128);
         wm->flush_screen();
       }
-          draw_map(f, 0);
+          draw_map(f, alpha);
     }
       }
       if(current_automap)
@@ -1503,11 +1600,14 @@ void Game::update_screen()
     show_time();
   }
 
-  if(state == RUN_STATE && cache.prof_is_on())
+  if(state == RUN_STATE && alpha == 256 && cache.prof_is_on())
     cache.prof_poll_end();
 
   wm->flush_screen();
 
+  if(alpha == 256)
+    capture_frame(main_screen, pal);
+
 }
 
 void Game::do_intro()
@@ -1515,6 +1615,26 @@ void Game::do_intro()
 
 }
 
+// Redraw the screen as often as frame_cap allows until the next tick is
+// due, blending objects and views between their last two simulated
+// positions. The tick's own frame is then drawn by update_screen() at 256.
+static void render_between_ticks(Timer &tick_timer)
+{
+    float const tick_ms = 1000.0f / 15;
+    float const frame_ms = 1000.0f / frame_cap;
+
+    for (;;)
+    {
+        float elapsed = tick_timer.PollMs();
+        if (elapsed + frame_ms > tick_ms)
+            break;
+
+        Timer frame_timer;
+        the_game->update_screen(Min(255, (int)(elapsed * 256 / tick_ms)));
+        frame_timer.WaitMs(frame_ms);
+    }
+}
+
 // FIXME: refactor this to use the Lol Engine main fixed-framerate loop?
 int Game::calc_speed()
 {
@@ -1549,6 +1669,8 @@ int Game::calc_speed()
         frame_panic = 0;
         if (!no_delay)
         {
+            if (frame_cap > 15 && state == RUN_STATE && !req_name[0])
+                render_between_ticks(frame_timer);
             frame_timer.WaitMs(1000.0f / 15);
             avg_ms -= 0.1f * deltams;
             avg_ms += 0.1f * 1000.0f / 15;
@@ -1859,8 +1981,7 @@ void net_send(int force = 0)
       p->get_input();
 
 
-      base->packet.write_uint8(SCMD_SYNC);
-      base->packet.write_uint16(make_sync());
+      write_sync(&base->packet);
 
       if(base->join_list)
       base->packet.write_uint8(SCMD_RELOAD);
@@ -1899,6 +2020,7 @@ void net_receive()
 void Game::step()
 {
   LSpace::Tmp.Clear();
+  Lisp::CollectIdle();
   if(current_level)
   {
     current_level->unactivate_all();
@@ -1907,6 +2029,7 @@ void Game::step()
     {
       if(f->m_focus)
       {
+    f->m_lastlastpos = f->m_lastpos;  // once per tick, for interpolation
     f->update_scroll();
     int w, h;
 
@@ -1953,6 +2076,8 @@ void Game::step()
   } else if(state == MENU_STATE)
     main_menu();
 
+  sound_flush();
+
   if((key_down('x') || key_down(JK_F4))
       && (key_down(JK_ALT_L) || key_down(JK_ALT_R))
       && confirm_quit())
@@ -2071,7 +2196,7 @@ void Game::draw(int scene_mode)
     main_screen->line(main_screen->Size().x-1, 0, main_screen->Size().x-1, main_screen->Size().y-1, bc); */
 
     for(view *f = first_view; f; f = f->next)
-        draw_map(f, 0);
+        draw_map(f);
 
     sbar.redraw(main_screen);
 }
@@ -2298,10 +2423,17 @@ int main(int argc, char *argv[])
     start_argc = argc;
     start_argv = argv;
 
+    char const *lisp_profile_file = NULL;
+    char const *capture_file = NULL;
+
     for (int i = 0; i < argc; i++)
     {
         if (!strcmp(argv[i], "-cprint"))
             external_print = 1;
+        else if (!strcmp(argv[i], "-lisp_profile") && i + 1 < argc)
+            lisp_profile_file = argv[++i];
+        else if (!strcmp(argv[i], "-capture") && i + 1 < argc)
+            capture_file = argv[++i];
     }
 
 #if (defined(__APPLE__) && !defined(__MACH__))
@@ -2367,6 +2499,11 @@ int main(int argc, char *argv[])
     set_spec_main_file("abuse.spe");
     check_for_lisp(argc, argv);
 
+    if (lisp_profile_file)
+        lisp_profile_start(1);
+    if (capture_file)
+        capture_start(capture_file);
+
     do
     {
         if (main_net_cfg && !main_net_cfg->notify_reset())
@@ -2503,6 +2640,11 @@ int main(int argc, char *argv[])
     }
     while (main_net_cfg && main_net_cfg->restart_state());
 
+    if (lisp_profile_file)
+        lisp_profile_stop(lisp_profile_file);
+    capture_stop();
+    light_uninit();
+
     delete stat_man;
     delete main_net_cfg; main_net_cfg = NULL;
 
@@ -126,7 +126,9 @@ public :
 
     void PutFg(ivec2 pos, int type);
     void PutBg(ivec2 pos, int type);
-  void draw_map(view *v, int interpolate=0);
+  void draw_map(view *v, int alpha=256);
+  void draw_map_overlay(view *v);
+  void draw_split_views(int alpha);
   void dev_scroll();
 
   int in_area(Event &ev, int x1, int y1, int x2, int y2);
@@ -139,7 +141,7 @@ public :
   void need_refresh() { refresh=1; }       // for development mode only
   palette *current_palette() { return pal; }
 
-  void update_screen();
+  void update_screen(int alpha=256);
   void get_input();
   void do_intro();
   void joy_calb(Event &ev);
@@ -25,8 +25,9 @@ Filter::Filter(int colors)
     memset(m_table, 0, m_size * sizeof(*m_table));
 }
 
-// Creates a conversion filter from one palette to another
-Filter::Filter(palette *from, palette *to)
+// Creates a conversion filter from one palette to another. If the caller
+// already has an index of the destination palette, it is used for lookups.
+Filter::Filter(palette *from, palette *to, PaletteIndex const *index)
 {
     m_size = Max(from->pal_size(), to->pal_size());
     m_table = (uint8_t *)malloc(m_size);
@@ -40,7 +41,8 @@ Filter::Filter(palette *from, palette *to)
        int r = *src++;
        int g = *src++;
        int b = *src++;
-       int color = to->find_closest(r, g, b);
+       int color = index ? index->FindClosest(r, g, b)
+                         : to->find_closest(r, g, b);
 
        // Make sure non-blacks don't get remapped to the transparency
        if ((r || g || b) && to->red(color) == 0
@@ -117,35 +119,18 @@ void Filter::PutImage(image *screen, image *im, ivec2 pos)
 
 ColorFilter::ColorFilter(palette *pal, int color_bits)
 {
-    int max = pal->pal_size();
     int mul = 1 << (8 - color_bits);
     m_size = 1 << color_bits;
     m_table = (uint8_t *)malloc(m_size * m_size * m_size);
 
+    PaletteIndex index(pal);
+
     /* For each colour in the RGB cube, find the nearest palette element. */
     for (int r = 0; r < m_size; r++)
     for (int g = 0; g < m_size; g++)
     for (int b = 0; b < m_size; b++)
-    {
-        int best = 256 * 256 * 3;
-        int color = 0;
-        uint8_t *pp = (uint8_t *)pal->addr();
-
-        for (int i = 0; i < max; i++)
-        {
-            int rd = *pp++ - r * mul,
-                gd = *pp++ - g * mul,
-                bd = *pp++ - b * mul;
-
-            int dist = rd * rd + bd * bd + gd * gd;
-            if (dist < best)
-            {
-                best = dist;
-                color = i;
-            }
-        }
-        m_table[(r * m_size + g) * m_size + b] = color;
-    }
+        m_table[(r * m_size + g) * m_size + b]
+            = index.FindClosest(r * mul, g * mul, b * mul);
 }
 
 ColorFilter::ColorFilter(spec_entry *e, bFILE *fp)
@@ -19,7 +19,7 @@ class Filter
 {
 public :
     Filter(int colors = 256);
-    Filter(palette *from, palette *to);
+    Filter(palette *from, palette *to, PaletteIndex const *index = NULL);
     ~Filter();
 
     void Set(int color_num, int change_to);
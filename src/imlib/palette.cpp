@@ -70,6 +70,78 @@ int palette::find_closest(uint8_t r, uint8_t g, uint8_t b)
    return c;
 }
 
+PaletteIndex::PaletteIndex(palette *pal)
+{
+    int colors = Min(pal->pal_size(), 256);
+
+    memset(m_rgb, 0, sizeof(m_rgb));
+    memcpy(m_rgb, pal->addr(), colors * 3);
+    m_list = (uint8_t *)malloc(8 * 8 * 8 * colors);
+
+    int mindist[256], total = 0;
+    for (int cell = 0; cell < 8 * 8 * 8; cell++)
+    {
+        int lo[3] = { (cell >> 6) << 5, ((cell >> 3) & 7) << 5,
+                      (cell & 7) << 5 };
+
+        // The closest entry to any colour in the cell is no further away
+        // than the smallest worst-case distance of all entries, so only
+        // entries whose best-case distance is within it are candidates.
+        int best = 0x100000;
+        for (int i = 0; i < colors; i++)
+        {
+            int dmin = 0, dmax = 0;
+            for (int k = 0; k < 3; k++)
+            {
+                int v = m_rgb[i * 3 + k];
+                int dnear = v < lo[k] ? lo[k] - v
+                          : v > lo[k] + 31 ? v - lo[k] - 31 : 0;
+                int dfar = Max(v - lo[k], lo[k] + 31 - v);
+                dmin += dnear * dnear;
+                dmax += dfar * dfar;
+            }
+            mindist[i] = dmin;
+            best = Min(best, dmax);
+        }
+
+        // Candidates are kept in palette order so that ties resolve to
+        // the same entry as find_closest()
+        m_start[cell] = total;
+        for (int i = 0; i < colors; i++)
+            if (mindist[i] <= best)
+                m_list[total++] = i;
+    }
+    m_start[8 * 8 * 8] = total;
+    m_list = (uint8_t *)realloc(m_list, total);
+}
+
+PaletteIndex::~PaletteIndex()
+{
+    free(m_list);
+}
+
+int PaletteIndex::FindClosest(uint8_t r, uint8_t g, uint8_t b) const
+{
+    int cell = ((r >> 5) << 6) | ((g >> 5) << 3) | (b >> 5);
+    int c = 0, d = 0x100000;
+
+    for (int n = m_start[cell]; n < m_start[cell + 1]; n++)
+    {
+        uint8_t const *cl = m_rgb + m_list[n] * 3;
+        int nd = ((int)r - cl[0]) * ((int)r - cl[0])
+               + ((int)g - cl[1]) * ((int)g - cl[1])
+               + ((int)b - cl[2]) * ((int)b - cl[2]);
+        if (nd < d)
+        {
+            c = m_list[n];
+            d = nd;
+            if (!d) // Exact match
+                break;
+        }
+    }
+    return c;
+}
+
 int palette::find_color(uint8_t r, uint8_t g, uint8_t b)
 {
   int i,ub,mask,find;
@@ -68,6 +68,26 @@ public :
   ~palette();
 } ;
 
+// Nearest colour lookups against a snapshot of a palette, giving the same
+// results as palette::find_closest(). The RGB cube is split into 8x8x8
+// cells and each cell lists the only entries that can be the closest to a
+// colour inside it, so a lookup scans a few entries instead of 256.
+// Building the index costs about as much as 512 plain lookups; use it for
+// table generation, not one-off queries.
+class PaletteIndex
+{
+public:
+    PaletteIndex(palette *pal);
+    ~PaletteIndex();
+
+    int FindClosest(uint8_t r, uint8_t g, uint8_t b) const;
+
+private:
+    uint8_t m_rgb[256 * 3];
+    int m_start[8 * 8 * 8 + 1];
+    uint8_t *m_list;
+};
+
 class quant_node : public linked_node
 {
   quant_node *padre;
@@ -50,24 +50,24 @@ int read_PCX_header(FILE *fp)
   return 1;
 }
 
-int write_PCX_header(FILE *fp)
+static int write_PCX_header(FILE *fp, PCX_header_type const &h)
 {
-  if (!fwrite(&PCX_header.manufactururer,1,1,fp)) return 0;
-  if (!fwrite(&PCX_header.version,1,1,fp)) return 0;
-  if (!fwrite(&PCX_header.encoding,1,1,fp)) return 0;
-  if (!fwrite(&PCX_header.bits_per_pixel,1,1,fp)) return 0;
-  write_uint16(fp,PCX_header.xmin);
-  write_uint16(fp,PCX_header.ymin);
-  write_uint16(fp,PCX_header.xmax);
-  write_uint16(fp,PCX_header.ymax);
-  write_uint16(fp,PCX_header.hres);
-  write_uint16(fp,PCX_header.vres);
-  if (!fwrite(PCX_header.palette,1,48,fp)) return 0;
-  if (!fwrite(&PCX_header.reserved,1,1,fp)) return 0;
-  if (!fwrite(&PCX_header.color_planes,1,1,fp)) return 0;
-  write_uint16(fp,PCX_header.bytes_per_line);
-  write_uint16(fp,PCX_header.palette_type);
-  if (!fwrite(PCX_header.filter,1,58,fp)) return 0;
+  if (!fwrite(&h.manufactururer,1,1,fp)) return 0;
+  if (!fwrite(&h.version,1,1,fp)) return 0;
+  if (!fwrite(&h.encoding,1,1,fp)) return 0;
+  if (!fwrite(&h.bits_per_pixel,1,1,fp)) return 0;
+  write_uint16(fp,h.xmin);
+  write_uint16(fp,h.ymin);
+  write_uint16(fp,h.xmax);
+  write_uint16(fp,h.ymax);
+  write_uint16(fp,h.hres);
+  write_uint16(fp,h.vres);
+  if (!fwrite(h.palette,1,48,fp)) return 0;
+  if (!fwrite(&h.reserved,1,1,fp)) return 0;
+  if (!fwrite(&h.color_planes,1,1,fp)) return 0;
+  write_uint16(fp,h.bytes_per_line);
+  write_uint16(fp,h.palette_type);
+  if (!fwrite(h.filter,1,58,fp)) return 0;
   return 1;
 }
 
@@ -146,42 +146,53 @@ image *read_PCX(char const *filename, palette *&pal)
 }
 
 void write_PCX(image *im, palette *pal, char const *filename)
+{
+  write_PCX(im->scan_line(0),im->Size(),(uint8_t const *)pal->addr(),filename);
+}
+
+// Does not touch any global state, so that the frame capture thread can
+// call it while the game keeps running
+void write_PCX(uint8_t const *pixels, ivec2 size, uint8_t const *rgb,
+               char const *filename)
 {
   FILE *fp=fopen(filename,"wb");
   if (!fp)
     return ;
 
-  PCX_header.manufactururer=10;
-  PCX_header.version=5;
-  PCX_header.encoding=1;
-  PCX_header.bits_per_pixel=8;
-  PCX_header.xmin=0;
-  PCX_header.ymin=0;
-  PCX_header.xmax=im->Size().x-1;
-  PCX_header.ymax=im->Size().y-1;
-  PCX_header.hres=320;
-  PCX_header.vres=200;
-  PCX_header.reserved=0;
-  PCX_header.color_planes=1;
-  PCX_header.bytes_per_line=im->Size().x;
-  PCX_header.palette_type=0;
-  memset(PCX_header.filter,0,58);
-
-  if (!write_PCX_header(fp))
+  PCX_header_type h;
+  h.manufactururer=10;
+  h.version=5;
+  h.encoding=1;
+  h.bits_per_pixel=8;
+  h.xmin=0;
+  h.ymin=0;
+  h.xmax=size.x-1;
+  h.ymax=size.y-1;
+  h.hres=320;
+  h.vres=200;
+  memset(h.palette,0,48);
+  h.reserved=0;
+  h.color_planes=1;
+  h.bytes_per_line=size.x;
+  h.palette_type=0;
+  memset(h.filter,0,58);
+
+  if (!write_PCX_header(fp,h))
   {
     fclose(fp);
     return;
   }
 
   int y,run_length,x;
-  unsigned char *sl,code;
-  for (y=0; y<im->Size().y; y++)
+  uint8_t const *sl;
+  unsigned char code;
+  for (y=0; y<size.y; y++)
   {
-    sl=im->scan_line(y);
-    for (x=0; x<im->Size().x; )
+    sl=pixels+y*size.x;
+    for (x=0; x<size.x; )
     {
       run_length=1;
-      while (x+run_length<im->Size().x && sl[x]==sl[x+run_length])
+      while (x+run_length<size.x && sl[x]==sl[x+run_length])
         run_length++;
       if (run_length==1 && sl[x]<64)
         fputc(sl[x],fp);
@@ -199,7 +210,6 @@ void write_PCX(image *im, palette *pal, char const *filename)
     }
   }
   fputc(12,fp);  // note that there is a palette attached
-  fwrite(pal->addr(),1,256*3,fp);
+  fwrite(rgb,1,256*3,fp);
   fclose(fp);
 }
-
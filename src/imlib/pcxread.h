@@ -15,6 +15,8 @@
 #include "palette.h"
 
 void write_PCX(image *im, palette *pal, char const *filename);
+void write_PCX(uint8_t const *pixels, ivec2 size, uint8_t const *rgb,
+               char const *filename);
 image *read_PCX(char const *filename, palette *&pal);
 
 #endif
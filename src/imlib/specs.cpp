@@ -54,7 +54,8 @@ char const *spec_types[] =
     "Data array",
     "Character2",
     "Particle",
-    "Extern lcache"
+    "Extern lcache",
+    "PCM sound"
 };
 
 
@@ -47,6 +47,7 @@ enum
     SPEC_CHARACTER2 = 21,
     SPEC_PARTICLE = 22,
     SPEC_EXTERNAL_LCACHE = 23,
+    SPEC_SFX_PCM = 24,
 };
 
 #define SPEC_SIGNATURE    "SPEC1.0"
@@ -54,6 +55,24 @@ enum
 
 #define SPEC_FLAG_LINK    1
 
+/*  SPEC_SFX_PCM entries hold a sound effect already converted to the mixer
+ *  output format, so that it can be played straight from the file mapping:
+ *  struct sfx_pcm
+ *  {
+ *      uint32_t rate;
+ *      uint16_t format;        // SFX_PCM_S16LSB or SFX_PCM_S16MSB
+ *      uint16_t channels;
+ *      uint32_t data_offset;   // from the entry start, file offset is aligned
+ *      uint32_t data_size;
+ *      uint8_t padding[data_offset - 16];
+ *      uint8_t samples[data_size];
+ *  }
+ */
+#define SFX_PCM_HEADER_SIZE 16
+#define SFX_PCM_ALIGN       16
+#define SFX_PCM_S16LSB      0x8010   // same values as SDL's AUDIO_S16LSB/MSB
+#define SFX_PCM_S16MSB      0x9010
+
 #define SPEC_SEARCH_INSIDE_OUTSIDE 1
 #define SPEC_SEARCH_OUTSIDE_INSIDE 2
 #define SPEC_SEARCH_INSIDE_ONLY    3
@@ -19,9 +19,31 @@
 
 #include "transimage.h"
 
+// A span is a run of solid pixels: its offset in the line and where its
+// pixels live in m_data. An image gets a span table once it has been drawn
+// HOT_DRAWS times without horizontal clipping, and the least recently used
+// tables are freed when they take more than SPAN_CACHE_BYTES altogether.
+#define HOT_DRAWS 8
+#define SPAN_CACHE_BYTES (1024 * 1024)
+
+struct TransSpan
+{
+    uint16_t x, len;
+    uint32_t src;
+};
+
+TransImage *TransImage::lru_first = NULL;
+TransImage *TransImage::lru_last = NULL;
+size_t TransImage::lru_bytes = 0;
+
 TransImage::TransImage(image *im, char const *name)
 {
     m_size = im->Size();
+    m_spans = NULL;
+    m_rows = NULL;
+    m_span_bytes = 0;
+    m_draws = 0;
+    m_lru_prev = m_lru_next = NULL;
 
     im->Lock();
 
@@ -94,9 +116,117 @@ TransImage::TransImage(image *im, char const *name)
 
 TransImage::~TransImage()
 {
+    FreeSpans();
     free(m_data);
 }
 
+void TransImage::LruUnlink()
+{
+    if (m_lru_prev)
+        m_lru_prev->m_lru_next = m_lru_next;
+    else
+        lru_first = m_lru_next;
+    if (m_lru_next)
+        m_lru_next->m_lru_prev = m_lru_prev;
+    else
+        lru_last = m_lru_prev;
+    m_lru_prev = m_lru_next = NULL;
+}
+
+void TransImage::FreeSpans()
+{
+    if (!m_spans)
+        return;
+
+    LruUnlink();
+    lru_bytes -= m_span_bytes;
+    free(m_spans);
+    m_spans = NULL;
+    m_rows = NULL;
+    m_span_bytes = 0;
+    m_draws = 0;
+}
+
+void TransImage::MakeSpans()
+{
+    int count = 0;
+    uint8_t *parser = m_data;
+
+    for (int y = 0; y < m_size.y; y++)
+        for (int ix = 0; ix < m_size.x; )
+        {
+            ix += *parser++;
+            if (ix >= m_size.x)
+                break;
+            count++;
+            ix += *parser;
+            parser += *parser + 1;
+        }
+
+    size_t bytes = count * sizeof(TransSpan) + (m_size.y + 1) * sizeof(int);
+    if (bytes > SPAN_CACHE_BYTES / 4)
+        return; // Not worth evicting everybody else for
+
+    while (lru_last && lru_bytes + bytes > SPAN_CACHE_BYTES)
+        lru_last->FreeSpans();
+
+    m_spans = (TransSpan *)malloc(bytes);
+    if (!m_spans)
+        return;
+    m_rows = (int *)(m_spans + count);
+    m_span_bytes = bytes;
+    lru_bytes += bytes;
+
+    TransSpan *span = m_spans;
+    parser = m_data;
+    for (int y = 0; y < m_size.y; y++)
+    {
+        m_rows[y] = span - m_spans;
+        for (int ix = 0; ix < m_size.x; )
+        {
+            ix += *parser++;
+            if (ix >= m_size.x)
+                break;
+            span->x = ix;
+            span->len = *parser;
+            span->src = parser + 1 - m_data;
+            span++;
+            ix += *parser;
+            parser += *parser + 1;
+        }
+    }
+    m_rows[m_size.y] = count;
+}
+
+// Return whether the span table can be used, moving the image to the
+// front of the LRU list or building the table if it just became hot.
+int TransImage::UseSpans()
+{
+    if (!m_spans)
+    {
+        if (++m_draws < HOT_DRAWS)
+            return 0;
+        MakeSpans();
+        if (!m_spans)
+        {
+            m_draws = 0;
+            return 0;
+        }
+    }
+    else if (lru_first == this)
+        return 1;
+    else
+        LruUnlink();
+
+    m_lru_next = lru_first;
+    if (lru_first)
+        lru_first->m_lru_prev = this;
+    else
+        lru_last = this;
+    lru_first = this;
+    return 1;
+}
+
 image *TransImage::ToImage()
 {
     image *im = new image(m_size);
@@ -122,8 +252,8 @@ uint8_t *TransImage::ClipToLine(image *screen, ivec2 pos1, ivec2 pos2,
 
     // Number of lines to skip, number of lines to draw, first line to draw
     int skiplines = Max(pos1.y - pos.y, 0);
-    ysteps = Min(pos2.y - pos.y, m_size.y - skiplines);
     pos.y += skiplines;
+    ysteps = Min(pos2.y - pos.y, m_size.y - skiplines);
 
     while (skiplines--)
     {
@@ -144,6 +274,47 @@ uint8_t *TransImage::ClipToLine(image *screen, ivec2 pos1, ivec2 pos2,
     return parser;
 }
 
+// Only called when the image is not clipped horizontally, so every span is
+// drawn whole and only the first and last lines need to be worked out.
+template<int N>
+void TransImage::PutSpans(image *screen, ivec2 pos, int y1, int y2,
+                          uint8_t color, uint8_t *map, uint8_t *map2)
+{
+    if (pos.y + m_size.y <= y1 || pos.y >= y2)
+        return;
+
+    int skiplines = Max(y1 - pos.y, 0);
+    pos.y += skiplines;
+    int ysteps = Min(y2 - pos.y, m_size.y - skiplines);
+
+    screen->AddDirty(pos, pos + ivec2(m_size.x, m_size.y));
+    screen->Lock();
+
+    uint8_t *screen_line = screen->scan_line(pos.y) + pos.x;
+    int sw = screen->Size().x;
+
+    for (int y = skiplines; y < skiplines + ysteps; y++, screen_line += sw)
+    {
+        TransSpan *span = m_spans + m_rows[y], *end = m_spans + m_rows[y + 1];
+        for (; span < end; span++)
+        {
+            uint8_t *sl = screen_line + span->x, *datap = m_data + span->src;
+
+            if (N == NORMAL || N == SCANLINE)
+                memcpy(sl, datap, span->len);
+            else if (N == COLOR)
+                memset(sl, color, span->len);
+            else if (N == REMAP)
+                for (int n = span->len; n--; )
+                    *sl++ = map[*datap++];
+            else if (N == REMAP2)
+                for (int n = span->len; n--; )
+                    *sl++ = map2[map[*datap++]];
+        }
+    }
+    screen->Unlock();
+}
+
 template<int N>
 void TransImage::PutImageGeneric(image *screen, ivec2 pos, uint8_t color,
                                  image *blend, ivec2 bpos, uint8_t *map,
@@ -163,6 +334,14 @@ void TransImage::PutImageGeneric(image *screen, ivec2 pos, uint8_t color,
             return;
     }
 
+    if ((N == NORMAL || N == SCANLINE || N == COLOR || N == REMAP
+          || N == REMAP2) && pos.x >= pos1.x && pos.x + m_size.x <= pos2.x
+         && UseSpans())
+    {
+        PutSpans<N>(screen, pos, pos1.y, pos2.y, color, map, map2);
+        return;
+    }
+
     uint8_t *datap = ClipToLine(screen, pos1, pos2, pos, ysteps),
             *screen_line, *blend_line = NULL, *paddr = NULL;
     if (!datap)
@@ -22,8 +22,14 @@
  *   uint8_t data[size]; // solid pixel values
  *   ...
  *   (no scan line wraps allowed, there can be a last skip value)
+ *
+ *  Images that keep being drawn without horizontal clipping also get a
+ *  flattened table of solid spans, so those draws do not have to parse
+ *  the RLE stream. The tables are kept in a size-bounded LRU list.
  */
 
+struct TransSpan;
+
 class TransImage
 {
 public:
@@ -63,9 +69,26 @@ private:
                          uint8_t *map1, uint8_t *map2, int amount,
                          int nframes, uint8_t *tint,
                          ColorFilter *f, palette *pal);
+    template<int N>
+    void PutSpans(image *screen, ivec2 pos, int y1, int y2, uint8_t color,
+                  uint8_t *map1, uint8_t *map2);
+
+    int UseSpans();
+    void MakeSpans();
+    void FreeSpans();
+    void LruUnlink();
 
     ivec2 m_size;
     uint8_t *m_data;
+
+    TransSpan *m_spans;
+    int *m_rows;          // index of the first span of each line, plus one
+    size_t m_span_bytes;
+    int m_draws;          // unclipped draws while there is no span table
+    TransImage *m_lru_prev, *m_lru_next;
+
+    static TransImage *lru_first, *lru_last;
+    static size_t lru_bytes;
 };
 
 #endif
@@ -10,16 +10,70 @@
 
 /*
  * This file contains serialisation methods for the cache system. It
- * is NOT used to load and save games.
- * XXX: this code has not been tested after the LObject refactor.
+ * is NOT used to load and save games. The compiled Lisp cache uses it
+ * to store the forms read from each script, see SYS_FUNC_LOAD.
+ * Symbols are stored by name so that the data can be loaded in a later
+ * run of the program.
  */
 
 #if defined HAVE_CONFIG_H
 #   include "config.h"
 #endif
 
+#include <cstdio>
+
 #include "lisp.h"
-#include "specs.h"
+#include "lisp_gc.h"
+#include "crc.h"
+#include "lcache.h"
+
+static void put_bytes(lcache_buffer *b, void const *buf, size_t count)
+{
+    if (b->pos + count > b->size)
+    {
+        b->size = b->size * 2 > b->pos + count ? b->size * 2
+                                               : b->pos + count + 4096;
+        b->data = (uint8_t *)realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->pos, buf, count);
+    b->pos += count;
+}
+
+static void put_uint8(lcache_buffer *b, uint8_t x)
+{
+    put_bytes(b, &x, 1);
+}
+
+static void put_uint32(lcache_buffer *b, uint32_t x)
+{
+    uint8_t buf[4] = { (uint8_t)x, (uint8_t)(x >> 8),
+                       (uint8_t)(x >> 16), (uint8_t)(x >> 24) };
+    put_bytes(b, buf, 4);
+}
+
+// Reads past the end leave zeroes and flag the buffer
+static uint8_t const *get_bytes(lcache_buffer *b, size_t count)
+{
+    if (b->error || count > b->size - b->pos)
+    {
+        b->error = 1;
+        return NULL;
+    }
+    b->pos += count;
+    return b->data + b->pos - count;
+}
+
+static uint8_t get_uint8(lcache_buffer *b)
+{
+    uint8_t const *p = get_bytes(b, 1);
+    return p ? p[0] : 0;
+}
+
+static uint32_t get_uint32(lcache_buffer *b)
+{
+    uint8_t const *p = get_bytes(b, 4);
+    return p ? p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24) : 0;
+}
 
 size_t block_size(LObject *level)  // return size needed to recreate this block
 {
@@ -41,87 +95,97 @@ size_t block_size(LObject *level)  // return size needed to recreate this block
             return ret;
         }
     case L_CHARACTER:
-        return sizeof(uint8_t) + sizeof(uint16_t);
+        return sizeof(uint8_t) + sizeof(uint32_t);
     case L_STRING:
         return sizeof(uint8_t) + sizeof(uint32_t)
                                + strlen(lstring_value(level)) + 1;
     case L_NUMBER:
-        return sizeof(uint8_t) + sizeof(uint32_t);
+        return sizeof(uint8_t) + 2 * sizeof(uint32_t);
     case L_SYMBOL:
-        return sizeof(uint8_t) + sizeof(uintptr_t);
+        return sizeof(uint8_t) + sizeof(uint32_t)
+            + strlen(lstring_value(((LSymbol *)level)->GetName())) + 1;
     }
 
     /* Do not serialise other types */
     return 0;
 }
 
-void write_level(bFILE *fp, LObject *level)
+void write_level(lcache_buffer *b, LObject *level)
 {
     int type = item_type(level);
-    fp->write_uint8(type);
+    put_uint8(b, type);
 
     switch (type)
     {
     case L_CONS_CELL:
         if (!level)
-            fp->write_uint32(0);
+            put_uint32(b, 0);
         else
         {
             size_t count = 0;
-            void *b = level;
-            for (; b && item_type(b) == L_CONS_CELL; b = CDR(b))
+            void *c = level;
+            for (; c && item_type(c) == L_CONS_CELL; c = CDR(c))
                 count++;
             /* If last element is not the empty list, it's a dotted list
              * and we need to save the last object. Write a negative size
              * to reflect that. */
-            fp->write_uint32(b ? -(int32_t)count : count);
-            if (b)
-                write_level(fp, (LObject *)b);
+            put_uint32(b, c ? -(int32_t)count : count);
+            if (c)
+                write_level(b, (LObject *)c);
 
-            for (b = level; b && item_type(b) == L_CONS_CELL; b = CDR(b))
-                write_level(fp, CAR(b));
+            for (c = level; c && item_type(c) == L_CONS_CELL; c = CDR(c))
+                write_level(b, CAR(c));
         }
         break;
     case L_CHARACTER:
-        fp->write_uint16(((LChar *)level)->GetValue());
+        put_uint32(b, ((LChar *)level)->GetValue());
         break;
     case L_STRING:
         {
             size_t count = strlen(lstring_value(level)) + 1;
-            fp->write_uint32(count);
-            fp->write(lstring_value(level), count);
+            put_uint32(b, count);
+            put_bytes(b, lstring_value(level), count);
         }
         break;
     case L_NUMBER:
-        fp->write_uint32(lnumber_value(level));
+        {
+            int64_t num = ((LNumber *)level)->GetValue();
+            put_uint32(b, (uint32_t)num);
+            put_uint32(b, (uint32_t)(num >> 32));
+        }
         break;
     case L_SYMBOL:
         {
-            uintptr_t p = (uintptr_t)level;
-            for (size_t i = 0; i < sizeof(uintptr_t); i++)
-            {
-                fp->write_uint8((uint8_t)p);
-                p >>= 8;
-            }
+            char const *name = lstring_value(((LSymbol *)level)->GetName());
+            size_t count = strlen(name) + 1;
+            put_uint32(b, count);
+            put_bytes(b, name, count);
         }
+        break;
     }
 }
 
-LObject *load_block(bFILE *fp)
+LObject *load_block(lcache_buffer *b)
 {
-    int type = fp->read_uint8();
+    int type = get_uint8(b);
 
     switch (type)
     {
     case L_CONS_CELL:
         {
-            int32_t t = (int32_t)fp->read_uint32();
+            int32_t t = (int32_t)get_uint32(b);
+            size_t total = t < 0 ? -(int64_t)t : t;
 
-            if (!t)
+            // every element takes at least one byte
+            if (!t || total > b->size - b->pos)
+            {
+                b->error |= (t != 0);
                 return NULL;
+            }
 
             LList *last = NULL, *first = NULL;
-            for (size_t count = abs(t); count--; )
+            PtrRef r1(first), r2(last);
+            for (size_t count = total; count--; )
             {
                 LList *c = LList::Create();
                 if (first)
@@ -130,36 +194,130 @@ LObject *load_block(bFILE *fp)
                     first = c;
                 last = c;
             }
-            last->m_cdr = (t < 0) ? (LObject *)load_block(fp) : NULL;
+            LObject *tmp = (t < 0) ? load_block(b) : NULL;
+            last->m_cdr = tmp;
 
             last = first;
-            for (size_t count = abs(t); count--; last = (LList *)last->m_cdr)
-                last->m_car = load_block(fp);
-            return first;
+            for (size_t count = total; count-- && !b->error;
+                 last = (LList *)last->m_cdr)
+            {
+                tmp = load_block(b);
+                last->m_car = tmp;
+            }
+            return b->error ? NULL : first;
         }
     case L_CHARACTER:
-        return LChar::Create(fp->read_uint16());
+        return LChar::Create(get_uint32(b));
     case L_STRING:
         {
-            size_t count = fp->read_uint32();
+            size_t count = get_uint32(b);
+            uint8_t const *p = get_bytes(b, count);
+            if (!p || !count || p[count - 1])
+            {
+                b->error = 1;
+                return NULL;
+            }
             LString *s = LString::Create(count);
-            fp->read(s->GetString(), count);
+            memcpy(s->GetString(), p, count);
             return s;
         }
     case L_NUMBER:
-        return LNumber::Create(fp->read_uint32());
+        {
+            uint32_t lo = get_uint32(b);
+            int64_t num = (int64_t)(int32_t)get_uint32(b) << 32 | lo;
+            return LNumber::Create((long)num);
+        }
     case L_SYMBOL:
         {
-            uintptr_t ret = 0, mul = 1;
-            for (size_t i = 0; i < sizeof(uintptr_t); i++)
+            size_t count = get_uint32(b);
+            uint8_t const *p = get_bytes(b, count);
+            if (!p || !count || p[count - 1])
             {
-                ret |= mul * fp->read_uint8();
-                mul *= 8;
+                b->error = 1;
+                return NULL;
             }
-            return (LObject *)ret;
+            return LSymbol::FindOrCreate((char const *)p);
         }
     }
 
+    b->error = 1;
     return NULL;
 }
 
+// Cache file header: magic, version, CRC32 and size of the source, then
+// the number, size and CRC32 of the serialised forms that follow.
+#define LCACHE_HEADER_SIZE (sizeof(LISP_CACHE_MAGIC) + 6 * sizeof(uint32_t))
+
+int lcache_read(char const *filename, uint32_t source_crc,
+                uint32_t source_size, lcache_buffer *b, uint32_t &count)
+{
+    memset(b, 0, sizeof(*b));
+
+    FILE *fp = fopen(filename, "rb");
+    if (!fp)
+        return 0;
+
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    if (size < (long)LCACHE_HEADER_SIZE)
+    {
+        fclose(fp);
+        return 0;
+    }
+
+    b->data = (uint8_t *)malloc(size);
+    b->size = fread(b->data, 1, size, fp);
+    fclose(fp);
+
+    uint8_t const *magic = get_bytes(b, sizeof(LISP_CACHE_MAGIC));
+    int ok = magic && !memcmp(magic, LISP_CACHE_MAGIC, sizeof(LISP_CACHE_MAGIC))
+              && get_uint32(b) == LISP_CACHE_VERSION
+              && get_uint32(b) == source_crc
+              && get_uint32(b) == source_size;
+    count = get_uint32(b);
+    uint32_t forms_size = get_uint32(b), forms_crc = get_uint32(b);
+
+    if (!ok || b->error || forms_size != b->size - b->pos
+         || calc_crc32(b->data + b->pos, forms_size) != forms_crc)
+    {
+        free(b->data);
+        memset(b, 0, sizeof(*b));
+        return 0;
+    }
+
+    return 1;
+}
+
+int lcache_write(char const *filename, uint32_t source_crc,
+                 uint32_t source_size, lcache_buffer *b, uint32_t count)
+{
+    lcache_buffer header;
+    memset(&header, 0, sizeof(header));
+    put_bytes(&header, LISP_CACHE_MAGIC, sizeof(LISP_CACHE_MAGIC));
+    put_uint32(&header, LISP_CACHE_VERSION);
+    put_uint32(&header, source_crc);
+    put_uint32(&header, source_size);
+    put_uint32(&header, count);
+    put_uint32(&header, b->pos);
+    put_uint32(&header, calc_crc32(b->data, b->pos));
+
+    // Write under a temporary name, so that only complete files are found
+    char tmpname[256];
+    snprintf(tmpname, sizeof(tmpname), "%s.tmp", filename);
+
+    int ok = 0;
+    FILE *fp = fopen(tmpname, "wb");
+    if (fp)
+    {
+        ok = fwrite(header.data, 1, header.pos, fp) == header.pos
+              && fwrite(b->data, 1, b->pos, fp) == b->pos;
+        ok = !fclose(fp) && ok;
+        ok = ok && !rename(tmpname, filename);
+        if (!ok)
+            remove(tmpname);
+    }
+    free(header.data);
+
+    return ok;
+}
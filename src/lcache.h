@@ -12,10 +12,31 @@
 #define __LCACHE_HPP_
 #include "lisp.h"
 
+// Compiled Lisp forms are cached in the save directory, see SYS_FUNC_LOAD.
+// Change the version whenever the format of the forms or the header changes.
+#define LISP_CACHE_MAGIC "ABUSELC"
+#define LISP_CACHE_VERSION 2
+
+// Serialised forms are built and read back in memory
+struct lcache_buffer
+{
+    uint8_t *data;
+    size_t size, pos;   // bytes allocated or available, and position
+    int error;          // a read went past the end or found bad data
+};
+
 // return number of bytes to save this block of code
 size_t block_size(LObject *level);
-void write_level(bFILE *fp, LObject *level);
-LObject *load_block(bFILE *fp);
+void write_level(lcache_buffer *b, LObject *level);
+LObject *load_block(lcache_buffer *b);  // sets b->error on bad data
+
+// Read a whole cache file. Returns 0 unless the file matches the source
+// and its forms pass their checksum, leaving b positioned at the forms.
+int lcache_read(char const *filename, uint32_t source_crc,
+                uint32_t source_size, lcache_buffer *b, uint32_t &count);
+// Write b->pos bytes of forms, returns 0 if any write failed
+int lcache_write(char const *filename, uint32_t source_crc,
+                 uint32_t source_size, lcache_buffer *b, uint32_t count);
 
 #endif
 
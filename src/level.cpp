@@ -36,7 +36,7 @@
 #include "status.h"
 #include "dev.h"
 #include "demo.h"
-#include "pcxread.h"
+#include "capture.h"
 #include "profile.h"
 #include "sbar.h"
 #include "cop.h"
@@ -44,6 +44,7 @@
 #include "lisp_gc.h"
 
 level *current_level;
+int sync_interval=15;   // a sample digests every object and all its lvars
 
 game_object *level::attacker(game_object *who)
 {
@@ -116,6 +117,7 @@ void level::load_fail()
 level::~level()
 {
   load_fail();
+  forget_map_image();
   if (attack_list) free(attack_list);
   if (target_list) free(target_list);
   if (block_list) free(block_list);
@@ -581,30 +583,89 @@ game_object *level::all_boundary_setback(game_object *subject, int32_t x1, int32
 
 //bFILE *rcheck=NULL,*rcheck_lp=NULL;
 
-void level::interpolate_draw_objects(view *v)
+// Active objects include everything near the view that needs to think, so
+// the ones whose image cannot reach the view are left out of the draw list.
+// Lisp draw functions may paint beyond the current frame, the beam weapons
+// for instance draw a line back to their last position, so for them the box
+// also covers last_x/last_y and is grown by the character's draw_range.
+static game_object **draw_list=NULL;
+static int draw_list_size=0;
+
+static int build_draw_list(game_object *first, view *v)
+{
+  int32_t vx1=v->m_aa.x+current_vxadd,vy1=v->m_aa.y+current_vyadd,
+          vx2=v->m_bb.x+current_vxadd,vy2=v->m_bb.y+current_vyadd;
+
+  int t=0;
+  for (game_object *o=first; o; o=o->next_active)
+  {
+    if (t==draw_list_size)
+    {
+      draw_list_size=draw_list_size*2+64;
+      draw_list=(game_object **)realloc(draw_list,draw_list_size*sizeof(game_object *));
+    }
+
+    if (!o->morph_status())
+    {
+      int32_t x1,y1,x2,y2;
+      o->picture_space(x1,y1,x2,y2);
+      CharacterType *c=figures[o->otype];
+      if (c->get_fun(OFUN_DRAW))
+      {
+        int32_t mx=Max(c->draw_rangex,32L),my=Max(c->draw_rangey,32L);
+        x1=Min(x1,o->last_x)-mx; x2=Max(x2,o->last_x)+mx;
+        y1=Min(y1,o->last_y)-my; y2=Max(y2,o->last_y)+my;
+      }
+      if (x2<vx1 || x1>vx2 || y2<vy1 || y1>vy2)
+        continue;
+    }
+    draw_list[t++]=o;
+  }
+  return t;
+}
+
+void level::interpolate_draw_objects(view *v, int alpha)
 {
-  int32_t old_x,old_y;
+  // last_x/last_y must survive the draw since several frames are drawn
+  // between two ticks, so the real positions are kept aside instead
+  static int32_t *saved=NULL;
+  static int saved_size=0;
   current_view=v;
 
+  int total=0;
   game_object *o=first_active;
   for (; o; o=o->next_active)
+    total++;
+  if (total*2>saved_size)
   {
-    old_x=o->x;
-    old_y=o->y;
-    o->x=(o->last_x+o->x)/2;
-    o->y=(o->last_y+o->y)/2;
-    o->last_x=old_x;
-    o->last_y=old_y;
+    saved_size=total*2+64;
+    saved=(int32_t *)realloc(saved,saved_size*sizeof(int32_t));
   }
 
-  for (o=first_active; o; o=o->next_active)
-    o->draw();
+  int32_t *s=saved;
+  for (o=first_active; o; o=o->next_active,s+=2)
+  {
+    s[0]=o->x;
+    s[1]=o->y;
+    if (abs(o->x-o->last_x)<128 && abs(o->y-o->last_y)<128)  // not teleported
+    {
+      o->x=o->last_x+(o->x-o->last_x)*alpha/256;
+      o->y=o->last_y+(o->y-o->last_y)*alpha/256;
+    }
+  }
+
+  int total_draw=build_draw_list(first_active,v);
+  for (int i=0; i<total_draw; i++)
+    draw_list[i]->draw();
 
-  for (o=first_active; o; o=o->next_active)
+  s=saved;
+  for (o=first_active; o; o=o->next_active,s+=2)
   {
-    o->x=o->last_x;
-    o->y=o->last_y;
+    o->x=s[0];
+    o->y=s[1];
   }
+
+  LSpace::Tmp.Clear();
 }
 
 bFILE *rcheck=NULL,*rcheck_lp=NULL;
@@ -761,6 +822,9 @@ int level::tick()
   check_collisions();
 //  wall_push();
 
+  if (sync_interval && (tick_counter()%sync_interval)==0)
+    sync_sample();
+
   set_tick_counter(tick_counter()+1);
 
   if (sshot_fcount!=-1)
@@ -770,7 +834,7 @@ int level::tick()
     {
       char name[100];
       sprintf(name,"shot%04d.pcx",screen_shot_on++);
-      write_PCX(main_screen,pal,name);
+      capture_pcx(main_screen,pal,name);
     }
   }
 
@@ -782,6 +846,33 @@ void level::set_tick_counter(uint32_t x)
   ctick=x;
 }
 
+// The map mode view shows the whole foreground at AUTOTILE scale. It is
+// drawn once into map_image and PutFg() keeps it up to date, so drawing the
+// map is a single PutPart instead of one micro image per tile.
+void level::draw_map_tile(int x, int y)
+{
+  image *im=the_game->get_fg(fgvalue(*(map_fg+x+y*fg_width)))->micro_image;
+  map_image->PutImage(im, ivec2(x*AUTOTILE_WIDTH, y*AUTOTILE_HEIGHT));
+}
+
+image *level::get_map_image()
+{
+  if (!map_image)
+  {
+    map_image=new image(ivec2(fg_width*AUTOTILE_WIDTH, fg_height*AUTOTILE_HEIGHT));
+    for (int y=0; y<fg_height; y++)
+      for (int x=0; x<fg_width; x++)
+        draw_map_tile(x, y);
+  }
+  return map_image;
+}
+
+void level::forget_map_image()
+{
+  delete map_image;
+  map_image=NULL;
+}
+
 void level::draw_areas(view *v)
 {
     for (area_controller *a = area_list; a; a = a->next)
@@ -807,8 +898,9 @@ void level::draw_objects(view *v)
       o->map_draw();
   } else
   {
-    for (; o; o=o->next_active)
-      o->draw();
+    int total_draw=build_draw_list(o,v);
+    for (int i=0; i<total_draw; i++)
+      draw_list[i]->draw();
   }
 
   LSpace::Tmp.Clear();
@@ -856,6 +948,7 @@ void level::set_size(int w, int h)
   free(map_bg);
   map_fg=new_fg;
   map_bg=new_bg;
+  forget_map_image();
   fg_width=w;
   fg_height=h;
   bg_height=nbh;
@@ -898,11 +991,7 @@ void level::old_load_objects(spec_directory *sd, bFILE *fp)
     for (i=0; i<old_tot; i++)
     {
       fp->read(old_name,fp->read_uint8());    // read the name
-      for (o_remap[i]=0xffff,j=0; j<total_objects; j++)  // check for matching current name
-      {
-    if (!strcmp(old_name,object_names[j]))
-          o_remap[i]=j;
-      }
+      o_remap[i]=find_object_type(old_name);  // 0xffff if no matching current name
     }
 
 
@@ -1013,7 +1102,7 @@ void level::load_objects(spec_directory *sd, bFILE *fp)
   spec_entry *se=sd->find("object_descripitions");
   total_objs=0;
   first=last=first_active=NULL;
-  int i,j;
+  int i;
   if (!se)
   {
     old_load_objects(sd,fp);
@@ -1034,14 +1123,9 @@ void level::load_objects(spec_directory *sd, bFILE *fp)
     for (i=0; i<old_tot; i++)
     {
       fp->read(old_name,fp->read_uint8());    // read the name
-      for (o_remap[i]=0xffff,j=0; j<total_objects; j++)  // check for matching current name
-      {
-    if (!strcmp(old_name,object_names[j]))
-    {
-          o_remap[i]=j;
-      o_backmap[j]=i;
-    }
-      }
+      o_remap[i]=find_object_type(old_name);  // 0xffff if no matching current name
+      if (o_remap[i]!=0xffff)
+        o_backmap[o_remap[i]]=i;
     }
 
     se=sd->find("describe_states");
@@ -1070,13 +1154,9 @@ void level::load_objects(spec_directory *sd, bFILE *fp)
     int new_type=o_remap[i];
     if (new_type<total_objects)     // make sure old object still exists
     {
-      int k=0;
-      for (; k<figures[new_type]->ts; k++)
-      {
-        if (figures[new_type]->seq[k] &&
-           !strcmp(lstring_value(((LSymbol *)figures[new_type]->seq_syms[k])->GetName()),old_name))
+      int k=figures[new_type]->find_state(old_name);
+      if (k>=0)
         *(s_remap[i]+j)=k;
-      }
     }
       }
     }
@@ -1108,15 +1188,9 @@ void level::load_objects(spec_directory *sd, bFILE *fp)
       int new_type=o_remap[i];
       if (new_type!=0xffff)        // make sure old object still exists
       {
-        int k=0;
-        for (; k<figures[new_type]->tiv; k++)
-        {
-          if (figures[new_type]->vars[k])
-          {
-        if (!strcmp(lstring_value(((LSymbol *)figures[new_type]->vars[k])->GetName()),old_name))
+        int k=figures[new_type]->find_var(old_name);
+        if (k>=0)
           *(v_remap[i]+j)=figures[new_type]->var_index[k];
-          }
-        }
       }
     }
       }
@@ -1271,7 +1345,10 @@ void level::load_objects(spec_directory *sd, bFILE *fp)
 level::level(spec_directory *sd, bFILE *fp, char const *lev_name)
 {
   spec_entry *e;
+  reset_bg_caches();
   area_list=NULL;
+  map_image=NULL;
+  sync_state=0;
 
   attack_list=NULL;
   attack_list_size=attack_total=0;
@@ -1428,6 +1505,7 @@ level::level(spec_directory *sd, bFILE *fp, char const *lev_name)
   delete_object_list(players);
   delete_object_list(objs);
 
+  sync_reset();
 }
 
 
@@ -2346,8 +2424,11 @@ int level::save(char const *filename, int save_all)
 level::level(int width, int height, char const *name)
 {
   the_game->need_refresh();
+  reset_bg_caches();
   area_list=NULL;
+  map_image=NULL;
   set_tick_counter(0);
+  sync_state=0;
 
   attack_list=NULL;
   attack_list_size=attack_total=0;
@@ -2393,6 +2474,7 @@ level::level(int width, int height, char const *name)
 
   total_objs=0;
   insert_players();
+  sync_reset();
 }
 
 
@@ -3256,6 +3338,54 @@ void level::write_object_info(char *filename)
 }
 
 
+// Sampled right after loading, so that the state goes out with the next
+// packet
+void level::sync_reset()
+{
+  sync_sample();
+  sync_tick=ctick;
+}
+
+// Every object is digested again: objects outside the active area still
+// change through with_object, linked objects and damage. This costs one
+// pass over every object and its lvars, hence the sync_interval.
+void level::sync_sample()
+{
+  sync_tick=ctick+1;
+  sync_state=0;
+  for (game_object *o=first; o; o=o->next)
+  {
+    o->sync_hash=o->sync_digest();
+    sync_state+=o->sync_hash;
+  }
+}
+
+void level::write_sync_info(char const *filename)
+{
+  FILE *fp=open_FILE(filename,"wb");
+  if (fp)
+  {
+    fprintf(fp,"tick %ld rand_on %d sync %08lx%08lx\n",(long)tick_counter(),rand_on,
+        (unsigned long)(sync_state>>32),(unsigned long)(sync_state&0xffffffff));
+    int i=0;
+    game_object *o=first;
+    for (; o; o=o->next,i++)
+    {
+      fprintf(fp,"%3d %08lx%08lx %s %d/%d %4ld %4ld %4ld %4ld %3d %d %d",i,
+          (unsigned long)(o->sync_hash>>32),(unsigned long)(o->sync_hash&0xffffffff),
+          o->otype==0xffff ? "(none)" : object_names[o->otype],o->state,o->current_frame,
+          (long)o->x,(long)o->y,(long)o->xvel(),(long)o->yvel(),o->hp(),o->aistate(),
+          o->aistate_time());
+      if (o->otype!=0xffff)
+        for (int j=0; j<figures[o->otype]->tv; j++)
+          fprintf(fp," %ld",(long)o->lvars[j]);
+      fprintf(fp,"\n");
+    }
+    fclose(fp);
+  }
+}
+
+
 area_controller::area_controller(int32_t X, int32_t Y, int32_t W, int32_t H, area_controller *Next)
 {
   x=X; y=Y; w=W; h=H;
@@ -74,6 +74,13 @@ class level        // contain map info and objects
   void add_all_block(game_object *who);
   uint32_t ctick;
 
+  image *map_image;                         // whole level at map scale, see get_map_image()
+  void draw_map_tile(int x, int y);
+
+  uint64_t sync_state;                      // sum of every object's sync_hash
+  uint32_t sync_tick;                       // tick counter right after the last sample
+  void sync_reset();
+
 public :
   char *original_name() { if (first_name) return first_name; else return Name; }
   uint32_t tick_counter() { return ctick; }
@@ -124,10 +131,13 @@ public :
                       return *(map_bg+pos.x+pos.y*bg_width);
                                      else return 0;
                     }
-  void PutFg(ivec2 pos, uint16_t tile) { *(map_fg+pos.x+pos.y*fg_width)=tile; }
+  void PutFg(ivec2 pos, uint16_t tile) { *(map_fg+pos.x+pos.y*fg_width)=tile;
+                                         if (map_image) draw_map_tile(pos.x,pos.y); }
   void PutBg(ivec2 pos, uint16_t tile) { *(map_bg+pos.x+pos.y*bg_width)=tile; }
+  image *get_map_image();                    // built on first use, then kept up to date
+  void forget_map_image();                   // the foretile images changed
   void draw_objects(view *v);
-  void interpolate_draw_objects(view *v);
+  void interpolate_draw_objects(view *v, int alpha);
   void draw_areas(view *v);
   int tick();                                // returns false if character is dead
   void check_collisions();
@@ -201,9 +211,15 @@ public :
   void write_player_info(bFILE *fp, object_node *save_list);
   void write_object_info(char *filename);
   void level_loaded_notify();
+
+  uint64_t sync_hash() { return sync_state; }
+  int sync_sampled() { return sync_tick==ctick; }  // is there a fresh sample to send?
+  void sync_sample();                        // re-digest every object
+  void write_sync_info(char const *filename);
 } ;
 
 extern level *current_level;
+extern int sync_interval;    // ticks between sync samples, 0 disables
 void pull_actives(game_object *o, game_object *&last_active, int &t);
 
 
@@ -14,6 +14,8 @@
 
 #include <stdlib.h>
 
+#include <SDL.h>
+
 #include "common.h"
 
 #include "light.h"
@@ -61,8 +63,12 @@ light_source *light_source::copy()
   return next;
 }
 
+static void light_map_invalidate(int32_t x1, int32_t y1, int32_t x2, int32_t y2);
+static void light_map_flush();
+
 void delete_all_lights()
 {
+  light_map_flush();
   while (first_light_source)
   {
     if (dev_cont)
@@ -78,6 +84,7 @@ void delete_light(light_source *which)
 {
   if (dev_cont)
     dev_cont->notify_deleted_light(which);
+  light_map_invalidate(which->x1,which->y1,which->x2,which->y2);
 
   if (which==first_light_source)
   {
@@ -98,6 +105,7 @@ void delete_light(light_source *which)
 
 void light_source::calc_range()
 {
+  light_map_invalidate(x1,y1,x2,y2);
   switch (type)
   {
     case 0 :
@@ -148,6 +156,7 @@ void light_source::calc_range()
 
   }
   mul_div=(1<<16)/(outer_radius-inner_radius)*64;
+  light_map_invalidate(x1,y1,x2,y2);
 }
 
 light_source::light_source(char Type, int32_t X, int32_t Y, int32_t Inner_radius,
@@ -161,6 +170,7 @@ light_source::light_source(char Type, int32_t X, int32_t Y, int32_t Inner_radius
   known=0;
   xshift=Xshift;
   yshift=Yshift;
+  x1=y1=0; x2=y2=-1;
   calc_range();
 }
 
@@ -185,7 +195,7 @@ light_source *add_light_source(char type, int32_t x, int32_t y,
 uint8_t *tints[TTINTS];
 uint8_t bright_tint[256];
 
-void calc_tint(uint8_t *tint, int rs, int gs, int bs, int ra, int ga, int ba, palette *pal)
+void calc_tint(uint8_t *tint, int rs, int gs, int bs, int ra, int ga, int ba, palette *pal, PaletteIndex const *index)
 {
   palette npal;
   memset(npal.addr(),0,256);
@@ -198,7 +208,7 @@ void calc_tint(uint8_t *tint, int rs, int gs, int bs, int ra, int ga, int ba, pa
     bs+=ba; if (bs>255) bs=255; else if (bs<0) bs=0;
   }
   Filter f(pal,&npal);
-  Filter f2(&npal,pal);
+  Filter f2(&npal,pal,index);
 
   for (i=0; i<256; i++,tint++)
     *tint=f2.GetMapping(f.GetMapping(i));
@@ -248,6 +258,7 @@ void calc_light_table(palette *pal)
     if( recalc )
     {
         dprintf("Palette has changed, recalculating light table...\n");
+        PaletteIndex index(pal);
         stat_man->push("white light",NULL);
         int color=0;
         for (; color<256; color++)
@@ -258,7 +269,7 @@ void calc_light_table(palette *pal)
             for (int intensity=63; intensity>=0; intensity--)
             {
                 if (r>0 || g>0 || b>0)
-                    white_light[intensity*256+color]=pal->find_closest(r,g,b);
+                    white_light[intensity*256+color]=index.FindClosest(r,g,b);
                 else
                     white_light[intensity*256+color]=0;
                 if (r) r--;  if (g) g--;  if (b) b--;
@@ -313,21 +324,21 @@ void calc_light_table(palette *pal)
       int r=pal->red(i)/2,g=255-pal->green(i)-30,b=pal->blue(i)*3/5+50;
       if (g<0) g=0;
       if (b>255) b=0;
-      *c=pal->find_closest(r,g,b);
+      *c=index.FindClosest(r,g,b);
     }
     for (i=0; i<256; i++)
     {
       int r=pal->red(i)+(255-pal->red(i))/2,
           g=pal->green(i)+(255-pal->green(i))/2,
           b=pal->blue(i)+(255-pal->blue(i))/2;
-      bright_tint[i]=pal->find_closest(r,g,b);
+      bright_tint[i]=index.FindClosest(r,g,b);
     }
 
     // make the colored tints
     for (i=1; i<TTINTS-1; i++)
     {
       stat_man->update(i*100/(TTINTS-1));
-      calc_tint(tints[i],ti[0],ti[1],ti[2],ti[3],ti[4],ti[5],pal);
+      calc_tint(tints[i],ti[0],ti[1],ti[2],ti[3],ti[4],ti[5],pal,&index);
       ti+=6;
     }
     stat_man->pop();
@@ -634,12 +645,15 @@ inline void MAP_2PUT(uint8_t * in_addr, uint8_t * out_addr, uint8_t * remap, int
 }
 
 uint16_t min_light_level;
-// calculate the light value for this block.  sum up all contritors
-inline int calc_light_value(light_patch *lp,   // light patch to look at
+// calculate the light this block gets from the lights alone, without the
+// ambient level. a solid rectangle light overrides everything, its value is
+// returned with LIGHT_SOLID set
+#define LIGHT_SOLID 0x80
+inline int calc_light_raw(light_patch *lp,   // light patch to look at
                 int32_t sx,           // screen x & y
                 int32_t sy)
 {
-  int lv=min_light_level,r2,light_count;
+  int lv=0,r2,light_count;
   register int dx,dy;           // x and y distances
 
   light_source **lon_p=lp->lights;
@@ -653,7 +667,7 @@ inline int calc_light_value(light_patch *lp,   // light patch to look at
                                      // see why it shouldn't..  all members are int32_t
 
     if (*dt==9)                      // (dt==type),  if light is a Solid rectangle, return it value
-      return fn->inner_radius;
+      return LIGHT_SOLID | fn->inner_radius;
     else
     {
       dt++;
@@ -682,6 +696,96 @@ inline int calc_light_value(light_patch *lp,   // light patch to look at
   else return lv;
 }
 
+inline int light_level(int raw, int min_level)
+{
+  if (raw & LIGHT_SOLID)
+    return raw & ~LIGHT_SOLID;
+  return Min(63, min_level + raw);
+}
+
+// Lights only change when they are added, removed or their calc_range() is
+// called, so the raw value of every 8x4 world block is kept in a map that
+// wraps around every LIGHT_MAP_W x LIGHT_MAP_H blocks. Changes invalidate
+// the blocks under the light's old and new range; the patch list is only
+// built for frames that uncover blocks the map does not hold.
+#define LIGHT_MAP_W 256
+#define LIGHT_MAP_H 512
+#define LIGHT_MAP_EMPTY 0x7fff
+
+struct light_map_cell
+{
+  int16_t bx, by;
+  uint8_t value;
+};
+
+static light_map_cell *light_map=NULL;
+
+static void light_map_invalidate(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+  if (!light_map || x1>x2 || y1>y2)
+    return;
+
+  int32_t bx1=x1>>3, by1=y1>>2, bx2=x2>>3, by2=y2>>2;
+  // every cell is visited at most once even for huge ranges
+  int32_t ex=Min(bx2, bx1+LIGHT_MAP_W-1), ey=Min(by2, by1+LIGHT_MAP_H-1);
+  for (int32_t by=by1; by<=ey; by++)
+  {
+    light_map_cell *row=light_map+(by&(LIGHT_MAP_H-1))*LIGHT_MAP_W;
+    for (int32_t bx=bx1; bx<=ex; bx++)
+    {
+      light_map_cell *c=row+(bx&(LIGHT_MAP_W-1));
+      if (c->bx>=bx1 && c->bx<=bx2 && c->by>=by1 && c->by<=by2)
+        c->bx=LIGHT_MAP_EMPTY;
+    }
+  }
+}
+
+static void light_map_flush()
+{
+  if (light_map)
+    for (int i=0; i<LIGHT_MAP_W*LIGHT_MAP_H; i++)
+      light_map[i].bx=LIGHT_MAP_EMPTY;
+}
+
+// raw light value of the 8x4 world block (bx, by), patches is built on the
+// first miss from the w x h screen area at screenx, screeny, widened to
+// whole blocks so that the partly visible left and top blocks are sampled
+// inside it. when shared, other threads are reading the map and a miss is
+// computed but not stored
+static int light_map_value(int32_t bx, int32_t by, light_patch *&patches,
+                           int w, int h, int32_t screenx, int32_t screeny,
+                           int shared=0)
+{
+  if (!light_map)
+  {
+    light_map=(light_map_cell *)malloc(sizeof(light_map_cell)*LIGHT_MAP_W*LIGHT_MAP_H);
+    light_map_flush();
+  }
+
+  light_map_cell *c=light_map+(by&(LIGHT_MAP_H-1))*LIGHT_MAP_W+(bx&(LIGHT_MAP_W-1));
+  if (c->bx==bx && c->by==by)
+    return c->value;
+
+  int32_t ax=screenx&~7, ay=screeny&~3;
+  w+=screenx-ax;
+  h+=screeny-ay;
+  if (!patches)
+    patches=make_patch_list(w, h, ax, ay);
+
+  int32_t px=Max(0, Min(w-1, (int)(bx*8-ax)));
+  int32_t py=Max(0, Min(h-1, (int)(by*4-ay)));
+  light_patch *lp=patches;
+  for (; (lp->y1>py || lp->y2<py || lp->x1>px || lp->x2<px); lp=lp->next);
+
+  if (shared)
+    return calc_light_raw(lp, bx*8, by*4);
+
+  c->bx=bx;
+  c->by=by;
+  c->value=calc_light_raw(lp, bx*8, by*4);
+  return c->value;
+}
+
 
 void remap_line_asm2(uint8_t *addr,uint8_t *light_lookup,uint8_t *remap_line,int count)
 //inline void remap_line_asm2(uint8_t *addr,uint8_t *light_lookup,uint8_t *remap_line,int count)
@@ -749,41 +853,17 @@ inline void put_8line(uint8_t *in_line, uint8_t *out_line, uint8_t *remap, uint8
 }
 
 
-void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient)
+// light the screen area caa..cbb (exclusive) showing the world at
+// screenx, screeny. the caller locks the screen
+static void light_area(image *sc, ivec2 caa, ivec2 cbb, int32_t screenx, int32_t screeny,
+                       uint8_t *light_lookup, int min_level, int lx_run, int shared)
 {
-  int lx_run=0,ly_run;                     // light block x & y run size in pixels ==  (1<<lx_run)
+  light_patch *first = NULL;     // only built if the light map misses
+  int w = cbb.x - caa.x, h = cbb.y - caa.y;
 
-  if (shutdown_lighting && !disable_autolight)
-    ambient=shutdown_lighting_value;
-
-  switch (light_detail)
-  {
-    case HIGH_DETAIL :
-    { lx_run=2; ly_run=1; } break;       // 4 x 2 patches
-    case MEDIUM_DETAIL :
-    { lx_run=3; ly_run=2; } break;       // 8 x 4 patches  (default)
-    case LOW_DETAIL :
-    { lx_run=4; ly_run=3; } break;       // 16 x 8 patches
-    case POOR_DETAIL :                   // poor detail is no lighting
-    return ;
-  }
-  if ((int)ambient+ambient_ramp<0)
-    min_light_level=0;
-  else if ((int)ambient+ambient_ramp>63)
-    min_light_level=63;
-  else min_light_level=(int)ambient+ambient_ramp;
-
-  if (ambient==63) return ;
-  ivec2 caa, cbb;
-  sc->GetClip(caa, cbb);
-
-  light_patch *first = make_patch_list(cbb.x - caa.x, cbb.y - caa.y, screenx, screeny);
-
-  int prefix_x=(screenx&7);
   int prefix=screenx&7;
   if (prefix)
     prefix=8-prefix;
-  int suffix_x = cbb.x - 1 - caa.x - (screenx & 7);
 
   int suffix = (cbb.x - caa.x - prefix) & 7;
 
@@ -791,12 +871,9 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 
   uint8_t *remap_line=(uint8_t *)malloc(remap_size);
 
-  light_patch *f=first;
-
-  main_screen->Lock();
 
-  int scr_w=main_screen->Size().x;
-  uint8_t *screen_line=main_screen->scan_line(caa.y)+caa.x;
+  int scr_w=sc->Size().x;
+  uint8_t *screen_line=sc->scan_line(caa.y)+caa.x;
 
   for (int y = caa.y; y < cbb.y; )
   {
@@ -809,16 +886,14 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
     if (y + todoy >= cbb.y)
       todoy = cbb.y - y;
 
-    int calcy=((y+screeny)&(~3))-caa.y;
+    int32_t by=(y-caa.y+screeny)>>2;
 
 
     if (suffix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>suffix_x || lp->x2<suffix_x); lp=lp->next);
       uint8_t * caddr=(uint8_t *)screen_line + cbb.x - caa.x - suffix;
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,suffix_x+screenx,calcy)<<8));
+      int32_t bx=(screenx+w-suffix)>>3;
+      uint8_t *r=light_lookup+(light_level(light_map_value(bx,by,first,w,h,screenx,screeny,shared),min_level)<<8);
       switch (todoy)
       {
     case 4 :
@@ -838,11 +913,7 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 
     if (prefix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>prefix_x || lp->x2<prefix_x); lp=lp->next);
-
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,prefix_x+screenx,calcy)<<8));
+      uint8_t *r=light_lookup+(light_level(light_map_value(screenx>>3,by,first,w,h,screenx,screeny,shared),min_level)<<8);
       uint8_t * caddr=(uint8_t *)screen_line;
       switch (todoy)
       {
@@ -865,11 +936,7 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 
 
     for (x=prefix,count=0; count<remap_size; count++,x+=8,rem++)
-    {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y || lp->x1>x || lp->x2<x); lp=lp->next);
-      *rem=calc_light_value(lp,x+screenx,calcy);
-    }
+      *rem=light_level(light_map_value((x+screenx)>>3,by,first,w,h,screenx,screeny,shared),min_level);
 
     switch (todoy)
     {
@@ -886,8 +953,6 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 
     screen_line-=prefix;
   }
-  main_screen->Unlock();
-
   while (first)
   {
     light_patch *p=first;
@@ -898,6 +963,166 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 }
 
 
+// light block x run size in pixels == (1<<lx_run), -1 for no lighting
+static int light_x_run()
+{
+  switch (light_detail)
+  {
+    case HIGH_DETAIL : return 2;         // 4 x 2 patches
+    case MEDIUM_DETAIL : return 3;       // 8 x 4 patches  (default)
+    case LOW_DETAIL : return 4;          // 16 x 8 patches
+  }
+  return -1;                             // poor detail is no lighting
+}
+
+static int light_min_level(uint16_t &ambient)
+{
+  if (shutdown_lighting && !disable_autolight)
+    ambient=shutdown_lighting_value;
+
+  return Max(0, Min(63, (int)ambient+ambient_ramp));
+}
+
+void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient)
+{
+  int lx_run=light_x_run();
+  if (lx_run<0)
+    return ;
+  min_light_level=light_min_level(ambient);
+
+  if (ambient==63) return ;
+  ivec2 caa, cbb;
+  sc->GetClip(caa, cbb);
+
+  sc->Lock();
+  light_area(sc, caa, cbb, screenx, screeny, light_lookup, min_light_level, lx_run, 0);
+  sc->Unlock();
+}
+
+// Split screen views cover disjoint parts of the screen and, once the light
+// map holds every block they show, only read shared state, so each one is
+// lit by its own worker thread. The map is filled beforehand on this
+// thread; blocks that two far apart views both map to are computed by the
+// workers without being stored.
+#define MAX_LIGHT_WORKERS 8
+
+struct light_worker
+{
+  SDL_Thread *thread;
+  SDL_sem *start;
+  light_job const *job;          // NULL tells the worker to quit
+};
+
+static light_worker light_workers[MAX_LIGHT_WORKERS];
+static int total_light_workers=0;
+static SDL_sem *light_workers_done=NULL;
+static image *light_job_screen;
+static uint8_t *light_job_lookup;
+static int light_job_run;
+
+static void light_job_run_one(light_job const *j, int shared)
+{
+  light_area(light_job_screen, j->aa, j->bb, j->screenx, j->screeny,
+             light_job_lookup, j->min_level, light_job_run, shared);
+}
+
+static int light_worker_main(void *arg)
+{
+  light_worker *w=(light_worker *)arg;
+  for (;;)
+  {
+    SDL_SemWait(w->start);
+    if (!w->job)
+      break;
+    light_job_run_one(w->job, 1);
+    SDL_SemPost(light_workers_done);
+  }
+  return 0;
+}
+
+static void light_map_fill(light_job const *j)
+{
+  int w=j->bb.x-j->aa.x, h=j->bb.y-j->aa.y;
+  if (w<=0 || h<=0)
+    return;
+
+  light_patch *first=NULL;
+  for (int32_t by=j->screeny>>2; by<=(j->screeny+h-1)>>2; by++)
+    for (int32_t bx=j->screenx>>3; bx<=(j->screenx+w-1)>>3; bx++)
+      light_map_value(bx,by,first,w,h,j->screenx,j->screeny);
+  delete_patch_list(first);
+}
+
+void light_screens(image *sc, light_job *jobs, int total, uint8_t *light_lookup)
+{
+  int lx_run=light_x_run();
+  if (lx_run<0)
+    return ;
+
+  int todo=0;
+  for (int i=0; i<total; i++)
+  {
+    jobs[i].min_level=min_light_level=light_min_level(jobs[i].ambient);
+    if (jobs[i].ambient!=63)
+    {
+      light_map_fill(jobs+i);
+      jobs[todo++]=jobs[i];
+    }
+  }
+
+  if (!light_workers_done)
+    light_workers_done=SDL_CreateSemaphore(0);
+  while (light_workers_done && total_light_workers<Min(todo-1, MAX_LIGHT_WORKERS))
+  {
+    light_worker *w=light_workers+total_light_workers;
+    w->start=SDL_CreateSemaphore(0);
+    w->thread=w->start ? SDL_CreateThread(light_worker_main, w) : NULL;
+    if (!w->thread)
+    {
+      if (w->start)
+        SDL_DestroySemaphore(w->start);
+      break;
+    }
+    total_light_workers++;
+  }
+
+  light_job_screen=sc;
+  light_job_lookup=light_lookup;
+  light_job_run=lx_run;
+
+  sc->Lock();
+  int started=Min(todo-1, total_light_workers);
+  for (int i=0; i<started; i++)
+  {
+    light_workers[i].job=jobs+i+1;
+    SDL_SemPost(light_workers[i].start);
+  }
+
+  // this thread takes the first view and any the workers could not take
+  light_job_run_one(jobs, started>0);
+  for (int i=started+1; i<todo; i++)
+    light_job_run_one(jobs+i, started>0);
+
+  for (int i=0; i<started; i++)
+    SDL_SemWait(light_workers_done);
+  sc->Unlock();
+}
+
+void light_uninit()
+{
+  for (int i=0; i<total_light_workers; i++)
+  {
+    light_workers[i].job=NULL;
+    SDL_SemPost(light_workers[i].start);
+    SDL_WaitThread(light_workers[i].thread, NULL);
+    SDL_DestroySemaphore(light_workers[i].start);
+  }
+  total_light_workers=0;
+  if (light_workers_done)
+    SDL_DestroySemaphore(light_workers_done);
+  light_workers_done=NULL;
+}
+
 void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient,
              image *out, int32_t out_x, int32_t out_y)
 {
@@ -951,16 +1176,15 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
     return ;
   }
 
-  light_patch *first = make_patch_list(cbb.x - caa.x, cbb.y - caa.y, screenx, screeny);
+  light_patch *first = NULL;     // only built if the light map misses
+  int w = cbb.x - caa.x, h = cbb.y - caa.y;
 
   int scr_w=sc->Size().x;
   int dscr_w=out->Size().x;
 
-  int prefix_x=(screenx&7);
   int prefix=screenx&7;
   if (prefix)
     prefix=8-prefix;
-  int suffix_x = cbb.x - 1 - caa.x - (screenx & 7);
 
   int suffix = (cbb.x - caa.x - prefix) & 7;
 
@@ -968,7 +1192,6 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
 
   uint8_t *remap_line=(uint8_t *)malloc(remap_size);
 
-  light_patch *f=first;
   uint8_t *in_line=sc->scan_line(caa.y)+caa.x;
   uint8_t *out_line=out->scan_line(caa.y*2+out_y)+caa.x*2+out_x;
 
@@ -984,18 +1207,16 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
     if (y + todoy >= cbb.y)
       todoy = cbb.y - y;
 
-    int calcy=((y+screeny)&(~3))-caa.y;
+    int32_t by=(y-caa.y+screeny)>>2;
 
 
     if (suffix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>suffix_x || lp->x2<suffix_x); lp=lp->next);
       uint8_t * caddr=(uint8_t *)in_line + cbb.x - caa.x - suffix;
       uint8_t * daddr=(uint8_t *)out_line+(cbb.x - caa.x - suffix)*2;
 
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,suffix_x+screenx,calcy)<<8));
+      int32_t bx=(screenx+w-suffix)>>3;
+      uint8_t *r=light_lookup+(light_level(light_map_value(bx,by,first,w,h,screenx,screeny),min_light_level)<<8);
       switch (todoy)
       {
     case 4 :
@@ -1023,11 +1244,7 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
 
     if (prefix)
     {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y ||
-                  lp->x1>prefix_x || lp->x2<prefix_x); lp=lp->next);
-
-      uint8_t *r=light_lookup+(((int32_t)calc_light_value(lp,prefix_x+screenx,calcy)<<8));
+      uint8_t *r=light_lookup+(light_level(light_map_value(screenx>>3,by,first,w,h,screenx,screeny),min_light_level)<<8);
       uint8_t * caddr=(uint8_t *)in_line;
       uint8_t * daddr=(uint8_t *)out_line;
       switch (todoy)
@@ -1061,11 +1278,7 @@ void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *l
 
 
     for (x=prefix,count=0; count<remap_size; count++,x+=8,rem++)
-    {
-      light_patch *lp=f;
-      for (; (lp->y1>y-caa.y || lp->y2<y-caa.y || lp->x1>x || lp->x2<x); lp=lp->next);
-      *rem=calc_light_value(lp,x+screenx,calcy);
-    }
+      *rem=light_level(light_map_value((x+screenx)>>3,by,first,w,h,screenx,screeny),min_light_level);
 
     rem=remap_line;
 
@@ -76,6 +76,18 @@ void light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lo
 void double_light_screen(image *sc, int32_t screenx, int32_t screeny, uint8_t *light_lookup, uint16_t ambient,
              image *out, int32_t out_x, int32_t out_y);
 
+// One screen area for light_screens(), which lights several disjoint areas
+// at the same time, one per thread
+struct light_job
+{
+  ivec2 aa, bb;                 // area of the screen, bb excluded
+  int32_t screenx, screeny;     // world position of aa
+  uint16_t ambient;
+  int min_level;                // set by light_screens()
+};
+void light_screens(image *sc, light_job *jobs, int total, uint8_t *light_lookup);
+void light_uninit();
+
 void calc_light_table(palette *pal);
 extern light_source *first_light_source;
 extern int light_detail;
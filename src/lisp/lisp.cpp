@@ -17,6 +17,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdarg.h>
+#include <setjmp.h>
+#include <time.h>
 
 #include "common.h"
 
@@ -34,6 +36,8 @@
 #   include "dprint.h"
 #   include "cache.h"
 #   include "dev.h"
+#   include "crc.h"
+#   include "lcache.h"
 #endif
 
 /* To bypass the whole garbage collection issue of lisp I am going to have
@@ -53,6 +57,9 @@ size_t LSymbol::count = 0;
 
 int print_level = 0, trace_level = 0, trace_print_level = 1000;
 int total_user_functions;
+// Bounds the C stack used by deep Lisp recursion
+#define MAX_EVAL_DEPTH 3000
+
 static int evaldepth = 0, maxevaldepth = 0;
 
 int break_level=0;
@@ -409,8 +416,11 @@ LSymbol *new_lisp_symbol(char *name)
     return s;
 }
 
-LNumber *LNumber::Create(long num)
+LObject *LNumber::Create(long num)
 {
+    if (num >= LISP_FIXNUM_MIN && num <= LISP_FIXNUM_MAX)
+        return (LObject *)(((uintptr_t)(intptr_t)num << 1) | 1);
+
     size_t size = Max(sizeof(LNumber), sizeof(LRedirect));
 
     LNumber *n = (LNumber *)LSpace::Current->Alloc(size);
@@ -485,7 +495,7 @@ int32_t lnumber_value(void *lnumber)
     switch (item_type(lnumber))
     {
     case L_NUMBER:
-        return ((LNumber *)lnumber)->m_num;
+        return ((LNumber *)lnumber)->GetValue();
     case L_FIXED_POINT:
         return ((LFixedPoint *)lnumber)->m_fixed >> 16;
     case L_STRING:
@@ -555,7 +565,7 @@ long lfixed_point_value(void *c)
   switch (item_type(c))
   {
     case L_NUMBER :
-      return ((LNumber *)c)->m_num<<16; break;
+      return ((LNumber *)c)->GetValue()<<16; break;
     case L_FIXED_POINT :
       return (((LFixedPoint *)c)->m_fixed); break;
     default :
@@ -573,10 +583,10 @@ void *lisp_eq(void *n1, void *n2)
   if (!n1 && !n2) return true_symbol;
   else if ((n1 && !n2) || (n2 && !n1)) return NULL;
   {
-    int t1=*((ltype *)n1), t2=*((ltype *)n2);
+    int t1=item_type(n1), t2=item_type(n2);
     if (t1!=t2) return NULL;
     else if (t1==L_NUMBER)
-    { if (((LNumber *)n1)->m_num==((LNumber *)n2)->m_num)
+    { if (((LNumber *)n1)->GetValue()==((LNumber *)n2)->GetValue())
         return true_symbol;
       else return NULL;
     } else if (t1==L_CHARACTER)
@@ -636,7 +646,7 @@ void *lisp_equal(void *n1, void *n2)
             return NULL;
           n1=CDR(n1);
           n2=CDR(n2);
-          if (n1 && *((ltype *)n1)!=L_CONS_CELL)
+          if (n1 && item_type(n1)!=L_CONS_CELL)
             return lisp_equal(n1, n2);
         }
         if (n1 || n2)
@@ -1180,9 +1190,9 @@ LObject *LObject::Compile(char const *&code)
     lerror(code, "mismatched )");
   else if (isdigit(n[0]) || (n[0]=='-' && isdigit(n[1])))
   {
-    LNumber *num = LNumber::Create(0);
-    sscanf(n, "%ld", &num->m_num);
-    ret=num;
+    long num = 0;
+    sscanf(n, "%ld", &num);
+    ret = LNumber::Create(num);
   } else if (n[0]=='"')
   {
     ret = LString::Create(str_token_len(code));
@@ -1299,7 +1309,7 @@ void LObject::Print()
         }
         break;
     case L_NUMBER:
-        sprintf(buf, "%ld", ((LNumber *)this)->m_num);
+        sprintf(buf, "%ld", ((LNumber *)this)->GetValue());
         lprint_string(buf);
         break;
     case L_SYMBOL:
@@ -1384,9 +1394,304 @@ void LObject::Print()
         dprintf("\n");
 }
 
+uint32_t var_name_hash(char const *name)
+{
+    uint32_t h = 2166136261u;
+    while (*name)
+        h = (h ^ (uint8_t)*name++) * 16777619u;
+    return h;
+}
+
+// Sampling profiler. User and C functions push themselves on a small call
+// stack; while the profiler runs, every 64th call (and every return to C)
+// checks the wall clock and charges the time elapsed since the last sample
+// to the current stack. Only time spent inside Lisp is counted; the process
+// CPU clock would also count the other threads (loader, capture, lighting),
+// but time the game thread spends preempted is charged too. The result
+// is written as folded stacks ("ai_fun;callee;builtin count"), one line per
+// distinct stack, ready for flamegraph tools.
+
+#define PROFILE_DEPTH 64
+
+static LSymbol *profile_stack[PROFILE_DEPTH];
+static int profile_depth = 0, profile_calls = 0;
+static int profiling_lisp = 0;
+static int64_t profile_interval, profile_last, profile_carry;  // microseconds
+
+struct ProfileEntry
+{
+    char *stack;
+    uint32_t count;
+};
+
+static ProfileEntry *profile_table = NULL;
+static size_t profile_size = 0, profile_used = 0;
+
+static int64_t profile_clock()
+{
+    static time_marker start;
+    time_marker now;
+    return (int64_t)(now.diff_time(&start) * 1000000.0);
+}
+
+static void profile_add(char *key, uint32_t count)
+{
+    if (profile_used * 2 >= profile_size)
+    {
+        ProfileEntry *old = profile_table;
+        size_t old_size = profile_size;
+
+        profile_size = old_size ? old_size * 2 : 256;
+        profile_table = (ProfileEntry *)calloc(profile_size,
+                                               sizeof(ProfileEntry));
+        profile_used = 0;
+        for (size_t i = 0; i < old_size; i++)
+            if (old[i].stack)
+            {
+                profile_add(old[i].stack, old[i].count);
+                free(old[i].stack);
+            }
+        free(old);
+    }
+
+    size_t i = var_name_hash(key) & (profile_size - 1);
+    while (profile_table[i].stack && strcmp(profile_table[i].stack, key))
+        i = (i + 1) & (profile_size - 1);
+
+    if (!profile_table[i].stack)
+    {
+        profile_table[i].stack = strdup(key);
+        profile_used++;
+    }
+    profile_table[i].count += count;
+}
+
+static void profile_sample(int force)
+{
+    if (!force && (++profile_calls & 63))
+        return;
+
+    int64_t now = profile_clock();
+    profile_carry += now - profile_last;
+    profile_last = now;
+    if (profile_carry < profile_interval)
+        return;
+
+    uint32_t count = profile_carry / profile_interval;
+    profile_carry -= count * profile_interval;
+
+    char key[1024];
+    size_t len = 0;
+    for (int i = 0; i < Min(profile_depth, PROFILE_DEPTH); i++)
+    {
+        char const *name = lstring_value(profile_stack[i]->GetName());
+        size_t n = strlen(name);
+        if (len + n + 2 > sizeof(key))
+            break;
+        if (len)
+            key[len++] = ';';
+        memcpy(key + len, name, n);
+        len += n;
+    }
+    key[len] = 0;
+    profile_add(key, count);
+}
+
+// Marks a function as running for the lifetime of the object
+class ProfileFrame
+{
+public:
+    inline ProfileFrame(LSymbol *sym)
+    {
+        if (profile_depth < PROFILE_DEPTH)
+            profile_stack[profile_depth] = sym;
+        // Depth is always tracked so that starting the profiler in the
+        // middle of a call stays balanced, but the clock is only read
+        // while profiling
+        if (++profile_depth == 1)
+        {
+            if (profiling_lisp)
+                profile_last = profile_clock();
+        }
+        else if (profiling_lisp)
+            profile_sample(0);
+    }
+
+    inline ~ProfileFrame()
+    {
+        if (profiling_lisp)
+            profile_sample(profile_depth == 1);
+        profile_depth--;
+    }
+};
+
+void lisp_profile_start(int interval_ms)
+{
+    profile_interval = Max(1, interval_ms) * (int64_t)1000;
+    profile_carry = 0;
+    profile_last = profile_clock();
+    profiling_lisp = 1;
+}
+
+void lisp_profile_stop(char const *filename)
+{
+    profiling_lisp = 0;
+
+    FILE *fp = fopen(filename, "w");
+    if (!fp)
+        dprintf("Unable to open %s for writing\n", filename);
+
+    for (size_t i = 0; i < profile_size; i++)
+        if (profile_table[i].stack)
+        {
+            if (fp)
+                fprintf(fp, "%s %d\n", profile_table[i].stack,
+                        (int)profile_table[i].count);
+            free(profile_table[i].stack);
+        }
+
+    if (fp)
+        fclose(fp);
+    free(profile_table);
+    profile_table = NULL;
+    profile_size = profile_used = 0;
+}
+
+// Binding forms save the old symbol values on l_user_stack and put them
+// back when they return. Each one also links an LBinding on the C stack,
+// so an aborted evaluation can restore the values it skips over. The
+// variable list is referenced through the form's own PtrRef'd local.
+enum
+{
+    BIND_SYMBOL, // vars is the symbol itself (for)
+    BIND_ARGS,   // vars is a list of symbols (user function arguments)
+    BIND_PAIRS   // vars is a list of (symbol ...) entries (let, do)
+};
+
+static struct LBinding *l_bindings = NULL;
+
+struct LBinding
+{
+    template<typename T> inline LBinding(T * const &vars, int kind,
+                                         size_t start, size_t count)
+    {
+        m_vars = (LObject * const *)&vars;
+        m_kind = kind;
+        m_start = start;
+        m_count = count;
+        m_prev = l_bindings;
+        l_bindings = this;
+    }
+
+    inline ~LBinding()
+    {
+        l_bindings = m_prev;
+    }
+
+    void Restore()
+    {
+        if (m_kind == BIND_SYMBOL)
+        {
+            if (m_count)
+                ((LSymbol *)*m_vars)->SetValue((LObject *)l_user_stack.sdata[m_start]);
+            return;
+        }
+
+        LObject *v = *m_vars;
+        for (size_t i = 0; i < m_count; i++, v = CDR(v))
+        {
+            LObject *sym = m_kind == BIND_ARGS ? CAR(v) : CAR(CAR(v));
+            ((LSymbol *)sym)->SetValue((LObject *)l_user_stack.sdata[m_start + i]);
+        }
+    }
+
+    LObject * const *m_vars;
+    int m_kind;
+    size_t m_start, m_count;
+    LBinding *m_prev;
+};
+
+// State saved by the outermost entry into the evaluator. Aborting an
+// evaluation restores it and resumes there, which then returns nil.
+struct LRecover
+{
+    jmp_buf env;
+    size_t user_stack, ref_stack;
+    LBinding *bindings;
+    LSpace *space;
+    bFILE *print_file;
+    int trace, breaks, profile;
+};
+
+static LRecover *eval_recover = NULL;
+
+enum { ENTER_EVAL, ENTER_FUNCTION, ENTER_USER_FUNCTION };
+
+static LObject *eval_outermost(LObject *obj, void *arg_list, int how)
+{
+    LRecover rec;
+    rec.user_stack = l_user_stack.m_size;
+    rec.ref_stack = PtrRef::stack.m_size;
+    rec.bindings = l_bindings;
+    rec.space = LSpace::Current;
+    rec.print_file = current_print_file;
+    rec.trace = trace_level;
+    rec.breaks = break_level;
+    rec.profile = profile_depth;
+
+    if (setjmp(rec.env))
+    {
+        eval_recover = NULL;
+        return NULL;
+    }
+
+    eval_recover = &rec;
+    LObject *ret = NULL;
+    switch (how)
+    {
+    case ENTER_EVAL:
+        ret = obj->Eval();
+        break;
+    case ENTER_FUNCTION:
+        ret = ((LSymbol *)obj)->EvalFunction(arg_list);
+        break;
+    case ENTER_USER_FUNCTION:
+        ret = ((LSymbol *)obj)->EvalUserFunction((LList *)arg_list);
+        break;
+    }
+    eval_recover = NULL;
+    return ret;
+}
+
+// Give up on the current evaluation: put back the symbol values saved by
+// every binding form in progress, drop everything pushed since the
+// outermost entry and resume there.
+static void eval_abort()
+{
+    LRecover *rec = eval_recover;
+
+    for (LBinding *b = l_bindings; b != rec->bindings; b = b->m_prev)
+        b->Restore();
+    l_bindings = rec->bindings;
+
+    l_user_stack.m_size = rec->user_stack;
+    PtrRef::stack.m_size = rec->ref_stack;
+    LSpace::Current = rec->space;
+    current_print_file = rec->print_file;
+    trace_level = rec->trace;
+    break_level = rec->breaks;
+    profile_depth = rec->profile;
+    evaldepth = 0;
+
+    longjmp(rec->env, 1);
+}
+
 /* PtrRef check: OK */
 LObject *LSymbol::EvalFunction(void *arg_list)
 {
+    if (!eval_recover)
+        return eval_outermost(this, arg_list, ENTER_FUNCTION);
+
 #ifdef TYPE_CHECKING
     int args, req_min, req_max;
     if (item_type(this) != L_SYMBOL)
@@ -1397,9 +1702,9 @@ LObject *LSymbol::EvalFunction(void *arg_list)
     }
 #endif
 
+    // Neither fun nor arg_list need a PtrRef here: fun_number is read before
+    // any argument is evaluated and each case protects arg_list itself.
     LObject *fun = m_function;
-    PtrRef ref2(fun);
-    PtrRef ref3(arg_list);
 
     // make sure the arguments given to the function are the correct number
     ltype t = item_type(fun);
@@ -1458,18 +1763,41 @@ LObject *LSymbol::EvalFunction(void *arg_list)
         ret = ((LSysFunction *)fun)->EvalFunction((LList *)arg_list);
         break;
     case L_L_FUNCTION:
+    {
+        PtrRef r1(arg_list);
+        ProfileFrame frame(this);
         ret = (LObject *)l_caller(((LSysFunction *)fun)->fun_number, arg_list);
         break;
+    }
     case L_USER_FUNCTION:
         return EvalUserFunction((LList *)arg_list);
     case L_C_FUNCTION:
     case L_C_BOOL:
     {
+        // Evaluated arguments go in cons cells on the C stack instead of
+        // the current space; Lisp::CollectObject() remaps such cells in
+        // place. Only unusually long argument lists are allocated.
+        LList stack_args[C_ARGS_ON_STACK];
+        long fun_number = ((LSysFunction *)fun)->fun_number;
+        size_t count = 0;
+        for (void *a = arg_list; a && count <= C_ARGS_ON_STACK; a = CDR(a))
+            count++;
+
         LList *first = NULL, *cur = NULL;
         PtrRef r1(first), r2(cur), r3(arg_list);
-        while (arg_list)
+        for (size_t n = 0; arg_list; n++)
         {
-            LList *tmp = LList::Create();
+            LList *tmp;
+            if (count <= C_ARGS_ON_STACK)
+            {
+                tmp = stack_args + n;
+                tmp->m_type = L_CONS_CELL;
+                tmp->m_car = NULL;
+                tmp->m_cdr = NULL;
+            }
+            else
+                tmp = LList::Create();
+
             if (first)
                 cur->m_cdr = tmp;
             else
@@ -1480,9 +1808,10 @@ LObject *LSymbol::EvalFunction(void *arg_list)
             ((LList *)cur)->m_car = val;
             arg_list = lcdr(arg_list);
         }
+        ProfileFrame frame(this);
         if (t == L_C_FUNCTION)
-            ret = LNumber::Create(c_caller(((LSysFunction *)fun)->fun_number, first));
-        else if (c_caller(((LSysFunction *)fun)->fun_number, first))
+            ret = LNumber::Create(c_caller(fun_number, first));
+        else if (c_caller(fun_number, first))
             ret = true_symbol;
         else
             ret = NULL;
@@ -1884,11 +2213,11 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             }
             else if (first)
             {
-                quot = ((LNumber *)i)->m_num;
+                quot = ((LNumber *)i)->GetValue();
                 first = 0;
             }
             else
-                quot /= ((LNumber *)i)->m_num;
+                quot /= ((LNumber *)i)->GetValue();
             arg_list = (LList *)CDR(arg_list);
         }
         ret = LNumber::Create(quot);
@@ -2060,8 +2389,10 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
         // make an a-list of new variable names and new values
         LObject *var_list = CAR(arg_list);
         LObject *block_list = CDR(arg_list);
-        PtrRef r1(block_list), r2(var_list);
+        LObject *vars = var_list;
+        PtrRef r1(block_list), r2(var_list), r3(vars);
         long stack_start = l_user_stack.m_size;
+        LBinding bound(vars, BIND_PAIRS, stack_start, 0);
 
         while (var_list)
         {
@@ -2076,6 +2407,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
 #endif
 
             l_user_stack.push(((LSymbol *)var_name)->m_value);
+            bound.m_count++;
             tmp = CAR(CDR(CAR(var_list)))->Eval();
             ((LSymbol *)var_name)->SetValue(tmp);
             var_list = CDR(var_list);
@@ -2090,7 +2422,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
         }
 
         long cur_stack = stack_start;
-        var_list = CAR(arg_list); // now restore the old symbol values
+        var_list = vars; // now restore the old symbol values
         while (var_list)
         {
             LObject *var_name = CAR(CAR(var_list));
@@ -2200,7 +2532,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             lbreak(" is not number type\n");
             exit(0);
         }
-        ret = LChar::Create(((LNumber *)i)->m_num);
+        ret = LChar::Create(((LNumber *)i)->GetValue());
         break;
     }
     case SYS_FUNC_COND:
@@ -2389,9 +2721,51 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
                 stat_man->push(msg, NULL);
             crc_manager.get_filenumber(st); // make sure this file gets crc'ed
 #endif
+            // The forms read from each script are cached in the save
+            // directory, keyed by the format version and the CRC32 and size
+            // of the source, so that later runs can skip the reader.
             LObject *compiled_form = NULL;
             PtrRef r11(compiled_form);
-            while (!end_of_program(cs))  // see if there is anything left to compile and run
+            uint32_t cached = 0; // forms already evaluated from the cache
+            int done = 0;
+#ifndef NO_LIBS
+            uint32_t crc = calc_crc32(s, l);
+            char cachename[200];
+            snprintf(cachename, sizeof(cachename), "%slisp%d-%08x%08x.bin",
+                     get_save_filename_prefix(), LISP_CACHE_VERSION,
+                     crc, (unsigned)l);
+
+            lcache_buffer cache_in, cache_out;
+            memset(&cache_out, 0, sizeof(cache_out));
+            uint32_t count;
+            if (lcache_read(cachename, crc, l, &cache_in, count))
+            {
+                for (; cached < count; cached++)
+                {
+                    if (stat_man)
+                        stat_man->update(cache_in.pos * 100 / cache_in.size);
+                    void *m = LSpace::Tmp.Mark();
+                    compiled_form = load_block(&cache_in);
+                    if (cache_in.error)
+                        break;
+                    compiled_form->Eval();
+                    compiled_form = NULL;
+                    LSpace::Tmp.Restore(m);
+                }
+
+                done = !cache_in.error && cache_in.pos == cache_in.size;
+                if (!done)
+                {
+                    // Read the rest from the source, skipping what already ran
+                    dprintf("Warning : ignoring damaged cache %s\n", cachename);
+                    compiled_form = NULL;
+                    remove(cachename);
+                }
+                free(cache_in.data);
+            }
+#endif
+            uint32_t forms = 0;
+            while (!done && !end_of_program(cs))  // see if there is anything left to compile and run
             {
 #ifndef NO_LIBS
                 if (stat_man)
@@ -2399,11 +2773,19 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
 #endif
                 void *m = LSpace::Tmp.Mark();
                 compiled_form = LObject::Compile(cs);
-                compiled_form->Eval();
+#ifndef NO_LIBS
+                write_level(&cache_out, compiled_form);
+#endif
+                if (forms++ >= cached)
+                    compiled_form->Eval();
                 compiled_form = NULL;
                 LSpace::Tmp.Restore(m);
             }
 #ifndef NO_LIBS
+            if (!done) // a failed write leaves no cache behind
+                lcache_write(cachename, crc, l, &cache_out, forms);
+            free(cache_out.data);
+
             if (stat_man)
             {
                 stat_man->update(100);
@@ -2581,6 +2963,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
         PtrRef r3(block);
         PtrRef r4(ret); // Required to protect from the last SetValue call
         l_user_stack.push(bind_var->GetValue());  // save old symbol value
+        LBinding bound(bind_var, BIND_SYMBOL, l_user_stack.m_size - 1, 1);
         while (ilist)
         {
             bind_var->SetValue((LObject *)CAR(ilist));
@@ -2688,7 +3071,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
     case SYS_FUNC_EQ0:
     {
         LObject *v = CAR(arg_list)->Eval();
-        if (item_type(v) != L_NUMBER || (((LNumber *)v)->m_num != 0))
+        if (item_type(v) != L_NUMBER || (((LNumber *)v)->GetValue() != 0))
             ret = NULL;
         else
             ret = true_symbol;
@@ -2763,9 +3146,13 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
             }
             l_user_stack.push(sym->GetValue());
         }
+        LObject *vars = CAR(arg_list);
+        PtrRef r3(vars);
+        LBinding bound(vars, BIND_PAIRS, ustack_start,
+                       l_user_stack.m_size - ustack_start);
 
-        void **do_evaled = l_user_stack.sdata + l_user_stack.m_size;
         // push all of the init forms, so we can set the symbol
+        size_t do_evaled = l_user_stack.m_size;
         for (init_var = CAR(arg_list); init_var; init_var = CDR(init_var))
             l_user_stack.push(CAR(CDR(CAR((init_var))))->Eval());
 
@@ -2773,8 +3160,7 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
         for (init_var = CAR(arg_list); init_var; init_var = CDR(init_var))
         {
             sym = (LSymbol *)CAR(CAR(init_var));
-            sym->SetValue((LObject *)*do_evaled);
-            do_evaled++;
+            sym->SetValue((LObject *)l_user_stack.sdata[do_evaled++]);
         }
 
         for (int i = 0; !i; ) // set i to 1 when terminate conditions are met
@@ -2791,12 +3177,11 @@ LObject *LSysFunction::EvalFunction(LList *arg_list)
         ret = CAR(CDR(CAR(CDR(arg_list))))->Eval();
 
         // restore old values for symbols
-        do_evaled = l_user_stack.sdata + ustack_start;
-        for (init_var = CAR(arg_list); init_var; init_var = CDR(init_var))
+        do_evaled = ustack_start;
+        for (init_var = vars; init_var; init_var = CDR(init_var))
         {
             sym = (LSymbol *)CAR(CAR(init_var));
-            sym->SetValue((LObject *)*do_evaled);
-            do_evaled++;
+            sym->SetValue((LObject *)l_user_stack.sdata[do_evaled++]);
         }
 
         l_user_stack.m_size = ustack_start;
@@ -2953,8 +3338,10 @@ void perm_space()
 /* PtrRef check: OK */
 LObject *LSymbol::EvalUserFunction(LList *arg_list)
 {
-    LObject *ret = NULL;
-    PtrRef ref1(ret);
+    if (!eval_recover)
+        return eval_outermost(this, arg_list, ENTER_USER_FUNCTION);
+
+    LObject *ret = NULL; // only live after the last allocation, no PtrRef
 
 #ifdef TYPE_CHECKING
     if (item_type(this) != L_SYMBOL)
@@ -2995,6 +3382,8 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
         LSymbol *s = (LSymbol *)CAR(f_arg);
         l_user_stack.push(s->m_value);
     }
+    LBinding bound(fun_arg_list, BIND_ARGS, stack_start,
+                   l_user_stack.m_size - stack_start);
 
     // open block so that local vars aren't saved on the stack
     {
@@ -3028,10 +3417,13 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
     }
 
     // now evaluate the function block
-    while (block_list)
     {
-        ret = CAR(block_list)->Eval();
-        block_list = (LList *)CDR(block_list);
+        ProfileFrame frame(this);
+        while (block_list)
+        {
+            ret = CAR(block_list)->Eval();
+            block_list = (LList *)CDR(block_list);
+        }
     }
 
     long cur_stack = stack_start;
@@ -3051,9 +3443,19 @@ LObject *LSymbol::EvalUserFunction(LList *arg_list)
 /* PtrRef check: OK */
 LObject *LObject::Eval()
 {
-    PtrRef ref1(this);
+    // No PtrRef for this: nothing below reads it after something may have
+    // allocated. Each callee protects the argument list it is handed.
+    if (!eval_recover)
+        return eval_outermost(this, NULL, ENTER_EVAL);
 
     maxevaldepth = Max(maxevaldepth, ++evaldepth);
+    if (evaldepth > MAX_EVAL_DEPTH)
+    {
+        Print();
+        dprintf("\nerror: evaluation nested deeper than %d, aborting it\n",
+                MAX_EVAL_DEPTH);
+        eval_abort();
+    }
 
     int tstart = trace_level;
 
@@ -3191,8 +3593,19 @@ void LSymbol::SetNumber(long num)
         exit(0);
     }
 #endif
-    if (m_value != l_undefined && item_type(m_value) == L_NUMBER)
+    if (m_value != l_undefined && item_type(m_value) == L_NUMBER
+         && !lisp_fixnum_p(m_value))
         ((LNumber *)m_value)->m_num = num;
+    else if (m_value != l_undefined && item_type(m_value) == L_NUMBER
+              && (num < LISP_FIXNUM_MIN || num > LISP_FIXNUM_MAX))
+    {
+        // The old value needed no storage and the new one does; put it
+        // where updating it in place later will not leave it dangling.
+        LSpace *sp = LSpace::Current;
+        LSpace::Current = &LSpace::Perm;
+        m_value = LNumber::Create(num);
+        LSpace::Current = sp;
+    }
     else
         m_value = LNumber::Create(num);
 }
@@ -20,6 +20,7 @@
 
 #define Cell void
 #define MAX_LISP_TOKEN_LEN 200
+#define C_ARGS_ON_STACK 8                 // see LSymbol::EvalFunction()
 
 #define FIXED_TRIG_SIZE 360               // 360 degrees stored in table
 extern int32_t sin_table[FIXED_TRIG_SIZE];   // this should be filled in by external module
@@ -53,6 +54,15 @@ enum
 // FIXME: switch this to uint8_t one day? it still breaks stuff
 typedef uint8_t ltype;
 
+// Small integers are not allocated: they are stored in the object pointer
+// itself as (num << 1) | 1. Allocated objects are always aligned, so the
+// lowest bit tells them apart.
+#define LISP_FIXNUM_MAX ((intptr_t)(~(uintptr_t)0 >> 2))
+#define LISP_FIXNUM_MIN (-LISP_FIXNUM_MAX - 1)
+
+static inline int lisp_fixnum_p(void const *x) { return (int)((uintptr_t)x & 1); }
+static inline long lisp_fixnum_value(void const *x) { return (long)((intptr_t)x >> 1); }
+
 struct LSpace
 {
     size_t GetFree();
@@ -109,7 +119,13 @@ struct LList : LObject
 struct LNumber : LObject
 {
     /* Factories */
-    static LNumber *Create(long num);
+    static LObject *Create(long num);
+
+    /* Methods */
+    inline long GetValue()
+    {
+        return lisp_fixnum_p(this) ? lisp_fixnum_value(this) : m_num;
+    }
 
     /* Members */
     long m_num;
@@ -239,6 +255,10 @@ public:
 
     // Collect temporary or permanent spaces
     static void CollectSpace(LSpace *which_space, int grow);
+    // Collect permanent space early if it is getting full, call between frames
+    static void CollectIdle();
+    // Seconds spent collecting since the last call
+    static double TakeCollectTime();
 
 private:
     static LArray *CollectArray(LArray *x);
@@ -250,7 +270,14 @@ private:
 
 static inline LObject *&CAR(void *x) { return ((LList *)x)->m_car; }
 static inline LObject *&CDR(void *x) { return ((LList *)x)->m_cdr; }
-static inline ltype item_type(void *x) { if (x) return *(ltype *)x; return L_CONS_CELL; }
+static inline ltype item_type(void *x)
+{
+    if (lisp_fixnum_p(x))
+        return L_NUMBER;
+    if (x)
+        return *(ltype *)x;
+    return L_CONS_CELL;
+}
 
 void perm_space();
 void tmp_space();
@@ -272,7 +299,10 @@ LSymbol *add_c_function(char const *name, short min_args, short max_args, short
 LSymbol *add_c_bool_fun(char const *name, short min_args, short max_args, short number);
 LSymbol *add_lisp_function(char const *name, short min_args, short max_args, short number);
 int read_ltoken(char *&s, char *buffer);
+uint32_t var_name_hash(char const *name); // for tables keyed by symbol name
 void print_trace_stack(int max_levels);
+void lisp_profile_start(int interval_ms);
+void lisp_profile_stop(char const *filename);
 
 
 LSysFunction *new_lisp_sys_function(int min_args, int max_args, int fun_number);
@@ -21,6 +21,7 @@
 #include "lisp_gc.h"
 
 #include "stack.h"
+#include "timing.h"
 
 /*  Lisp garbage collection: uses copy/free algorithm
     Places to check:
@@ -32,10 +33,10 @@
 */
 
 // Stack where user programs can push data and have it GCed
-GrowStack<void> l_user_stack(150);
+GrowStack<void> l_user_stack(256, 0x10000);
 
 // Stack of user pointers
-GrowStack<void *> PtrRef::stack(1500);
+GrowStack<void *> PtrRef::stack(2048, 0x40000);
 
 static size_t reg_ptr_total = 0;
 static void ***reg_ptr_list = NULL;
@@ -86,6 +87,10 @@ LObject *Lisp::CollectObject(LObject *x)
 {
     LObject *ret = x;
 
+    // Immediate numbers live in the pointer and never need collecting
+    if (lisp_fixnum_p(x))
+        return ret;
+
     maxgcdepth = Max(maxgcdepth, ++gcdepth);
 
     if ((uint8_t *)x >= cstart && (uint8_t *)x < cend)
@@ -210,8 +215,12 @@ void Lisp::CollectStacks()
     }
 }
 
+static double collect_time = 0.0;
+static size_t perm_live = 0;
+
 void Lisp::CollectSpace(LSpace *which_space, int grow)
 {
+    time_marker start;
     LSpace *sp = LSpace::Current;
 
     maxgcdepth = gcdepth = 0;
@@ -239,6 +248,31 @@ void Lisp::CollectSpace(LSpace *which_space, int grow)
     which_space->m_size = LSpace::Gc.m_size;
     which_space->m_free = new_data + (LSpace::Gc.m_free - LSpace::Gc.m_data);
 
+    if (which_space == &LSpace::Perm)
+        perm_live = which_space->m_free - which_space->m_data;
+
     LSpace::Current = sp;
+
+    time_marker now;
+    collect_time += now.diff_time(&start);
+}
+
+// A collection copies every live cell, so its cost cannot be split up, but
+// it can be moved. Running it here between frames, with the temporary space
+// empty, keeps it from landing in the middle of an object's AI, and growing
+// the space when most of it survives keeps collections rare.
+void Lisp::CollectIdle()
+{
+    if (LSpace::Perm.GetFree() > LSpace::Perm.m_size / 4)
+        return;
+
+    CollectSpace(&LSpace::Perm, perm_live > LSpace::Perm.m_size / 2);
+}
+
+double Lisp::TakeCollectTime()
+{
+    double ret = collect_time;
+    collect_time = 0.0;
+    return ret;
 }
 
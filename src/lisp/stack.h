@@ -14,15 +14,17 @@
 #include <stdio.h>
 #include <stdlib.h>
 
-// A fixed-size stack class
+// A stack that grows on demand, up to a hard limit. Users may index sdata
+// directly, but must not keep pointers into it across a push.
 template<class T> class GrowStack
 {
 public:
-    GrowStack(int max_size)
+    GrowStack(int initial_size, int max_size)
     {
         m_max_size = max_size;
+        m_alloc_size = initial_size;
         m_size = 0;
-        sdata = (T **)malloc(sizeof(T *) * m_max_size);
+        sdata = (T **)malloc(sizeof(T *) * m_alloc_size);
     }
 
     ~GrowStack()
@@ -32,14 +34,10 @@ public:
         free(sdata);
     }
 
-    void push(T *data)
+    inline void push(T *data)
     {
-        if (m_size >= m_max_size)
-        {
-            lbreak("error: stack overflow (%d >= %d)\n",
-                   (int)m_size, (int)m_max_size);
-            exit(1);
-        }
+        if (m_size >= m_alloc_size)
+            grow();
         sdata[m_size] = data;
         m_size++;
     }
@@ -60,7 +58,21 @@ public:
     size_t m_size;
 
 private:
-    size_t m_max_size;
+    void grow()
+    {
+        if (m_alloc_size >= m_max_size)
+        {
+            lbreak("error: stack overflow (%d >= %d), "
+                   "Lisp recursion is probably too deep\n",
+                   (int)m_size, (int)m_max_size);
+            exit(1);
+        }
+        m_alloc_size = m_alloc_size * 2 < m_max_size ? m_alloc_size * 2
+                                                     : m_max_size;
+        sdata = (T **)realloc(sdata, sizeof(T *) * m_alloc_size);
+    }
+
+    size_t m_alloc_size, m_max_size;
 };
 
 #endif
@@ -277,6 +277,9 @@ void load_tiles(Cell *file_list)
     } else delete fp;
   }
 
+  reset_bg_caches();    // views may hold redefined background tiles
+  if (current_level)
+    current_level->forget_map_image();
 }
 
 
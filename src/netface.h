@@ -94,7 +94,8 @@ enum {
        SCMD_EXT_KEYPRESS,
        SCMD_EXT_KEYRELEASE,
        SCMD_CHAT_KEYPRESS,
-       SCMD_SYNC
+       SCMD_SYNC,
+       SCMD_SYNC_STATE
      };
 
 
@@ -34,6 +34,44 @@ int total_objects;
 game_object *current_object;
 view *current_view;
 
+static short *object_hash = NULL;   // open addressed name -> type, -1 = empty
+static int object_hash_size = 0;
+
+static void object_hash_insert(int type)
+{
+  // a redefined name maps to the newest type
+  int i=var_name_hash(object_names[type])&(object_hash_size-1);
+  while (object_hash[i]>=0 && strcmp(object_names[object_hash[i]],object_names[type]))
+    i=(i+1)&(object_hash_size-1);
+  object_hash[i]=type;
+}
+
+// called by def_char, the first type starts a fresh table
+void add_object_name(int type, char const *name)
+{
+  object_names[type]=strdup(name);
+  if (!type || (type+1)*2>object_hash_size)
+  {
+    object_hash_size=type ? object_hash_size*2 : 64;
+    object_hash=(short *)realloc(object_hash,sizeof(short)*object_hash_size);
+    memset(object_hash,0xff,sizeof(short)*object_hash_size);
+    for (int i=0; i<type; i++)
+      object_hash_insert(i);
+  }
+  object_hash_insert(type);
+}
+
+int find_object_type(char const *name)
+{
+  if (!object_hash_size)
+    return -1;
+  int i=var_name_hash(name)&(object_hash_size-1);
+  for (; object_hash[i]>=0; i=(i+1)&(object_hash_size-1))
+    if (!strcmp(object_names[object_hash[i]],name))
+      return object_hash[i];
+  return -1;
+}
+
 game_object *game_object::copy()
 {
   game_object *o=create(otype,x,y);
@@ -92,50 +130,33 @@ obj_desc object_descriptions[TOTAL_OBJECT_VARS] =
 int32_t game_object::get_var_by_name(char *name, int &error)
 {
   error=0;
-  int i=0;
-  for (; i<TOTAL_OBJECT_VARS; i++)
-  {
-    if (!strcmp(object_descriptions[i].name,name))
-      return get_var(i);
-  }
+  int i=simple_object::var_number(name);
+  if (i>=0)
+    return get_var(i);
+
+  i=figures[otype]->find_var(name);
+  if (i>=0)
+    return lvars[figures[otype]->var_index[i]];
 
-  for (i=0; i<figures[otype]->tiv; i++)
-  {
-    if (!strcmp(lstring_value(((LSymbol *)figures[otype]->vars[i])->GetName()),name))
-    {
-      return lvars[figures[otype]->var_index[i]];
-/*      LObjectVar *cobj=(LObjectVar *)symbol_value(figures[otype]->vars[i]);
-      CharacterType *t=figures[otype];
-      int number=cobj->number;
-      if (t->tiv<=number || !t->vars[number])
-      {
-    lbreak("access : variable does not exists for this class\n");
-    return 0;
-      }
-      return lvars[t->var_index[number]]; */
-    }
-  }
   error=1;
   return 0;
 }
 
 int game_object::set_var_by_name(char *name, int32_t value)
 {
-  int i=0;
-  for (; i<TOTAL_OBJECT_VARS; i++)
+  int i=simple_object::var_number(name);
+  if (i>=0)
   {
-    if (!strcmp(object_descriptions[i].name,name))
-    {
-      set_var(i,value);
-      return 1;
-    }
+    set_var(i,value);
+    return 1;
+  }
+
+  i=figures[otype]->find_var(name);
+  if (i>=0)
+  {
+    lvars[figures[otype]->var_index[i]]=value;
+    return 1;
   }
-  for (i=0; i<figures[otype]->tiv; i++)
-    if (!strcmp(lstring_value(((LSymbol *)figures[otype]->vars[i])->GetName()),name))
-    {
-      lvars[figures[otype]->var_index[i]]=value;
-      return 1;
-    }
   return 0;
 }
 
@@ -145,6 +166,28 @@ char const *simple_object::var_name(int x)
   return object_descriptions[x].name;
 }
 
+int simple_object::var_number(char const *name)
+{
+  static int8_t table[64];
+  static int init=0;
+  if (!init)
+  {
+    memset(table,0xff,sizeof(table));
+    for (int i=0; i<TOTAL_OBJECT_VARS; i++)
+    {
+      int h=var_name_hash(object_descriptions[i].name)&63;
+      while (table[h]>=0) h=(h+1)&63;
+      table[h]=i;
+    }
+    init=1;
+  }
+
+  for (int h=var_name_hash(name)&63; table[h]>=0; h=(h+1)&63)
+    if (!strcmp(object_descriptions[table[h]].name,name))
+      return table[h];
+  return -1;
+}
+
 int simple_object::var_type(int x)
 {
   return object_descriptions[x].type;
@@ -1525,6 +1568,47 @@ void delete_object_list(object_node *first)
 }
 
 
+static inline uint64_t sync_mix(uint64_t h, uint32_t v)
+{
+  h=(h^v)*0x9e3779b97f4a7c15ULL;
+  return h^(h>>29);
+}
+
+uint64_t game_object::sync_digest()
+{
+  uint64_t h=0xcbf29ce484222325ULL;
+  h=sync_mix(h,otype);
+  h=sync_mix(h,(uint32_t)state);
+  h=sync_mix(h,current_frame);
+  h=sync_mix(h,x);
+  h=sync_mix(h,y);
+  h=sync_mix(h,Xvel);
+  h=sync_mix(h,Yvel);
+  h=sync_mix(h,Xacel);
+  h=sync_mix(h,Yacel);
+  h=sync_mix(h,(Fx<<24)|(Fy<<16)|(Fxvel<<8)|Fyvel);
+  h=sync_mix(h,(Fxacel<<24)|(Fyacel<<16)|(Aitype<<8)|Flags);
+  h=sync_mix(h,(Aistate<<16)|Aistate_time);
+  h=sync_mix(h,(Hp<<16)|Mp);
+  h=sync_mix(h,Fmp);
+  h=sync_mix(h,((uint8_t)direction<<24)|((uint8_t)active<<16)|(grav_on<<8)|targetable_on);
+  h=sync_mix(h,((uint8_t)Fade_dir<<24)|(Fade_count<<16)|(Fade_max<<8)|(uint8_t)Frame_dir);
+
+  if (otype!=0xffff)
+  {
+    int t=figures[otype]->tv;
+    for (int i=0; i<t; i++)
+      h=sync_mix(h,lvars[i]);
+  }
+
+  // final avalanche so that summing digests in the level does not cancel out
+  h^=h>>33;
+  h*=0xff51afd7ed558ccdULL;
+  h^=h>>33;
+  return h;
+}
+
+
 int32_t object_list_length(object_node *list)
 {
   int32_t x=0;
@@ -1538,6 +1622,7 @@ int32_t object_list_length(object_node *list)
 game_object::game_object(int Type, int load)
 {
   lvars = NULL;
+  sync_hash = 0;
 
   if (Type<0xffff)
   {
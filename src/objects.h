@@ -23,6 +23,9 @@ class view;
 extern char **object_names;
 extern int total_objects;
 
+void add_object_name(int type, char const *name);
+int find_object_type(char const *name);   // -1 if no such object
+
 #define NOT_BLOCKED 0
 #define BLOCKED_LEFT 1
 #define BLOCKED_RIGHT 2
@@ -58,6 +61,9 @@ class game_object : public simple_object
 public :
   game_object *next,*next_active;
   int32_t *lvars;
+  uint64_t sync_hash;   // digest at the level's last sync sample
+
+  uint64_t sync_digest();  // hash of physics and lisp visible fields
 
   int size();
   int decide();        // returns 0 if you want to be deleted
@@ -19,11 +19,20 @@
 #include "lisp.h"
 #include "cache.h"
 #include "jrand.h"
+#include "game.h"
 
 
 static int total_pseqs=0;
 static part_sequence **pseqs=NULL;
-static part_animation *first_anim=NULL,*last_anim=NULL;
+
+// Running animations are kept in start order as parallel arrays that are
+// only ever grown, so ticking and drawing walk memory linearly and big
+// explosions do not allocate a node per animation
+static int total_panims=0,panim_size=0;
+static part_sequence **panim_seq=NULL;
+static int32_t *panim_x=NULL,*panim_y=NULL;
+static uint16_t *panim_frame=NULL;
+static int8_t *panim_dir=NULL;
 
 void free_pframes()
 {
@@ -35,31 +44,35 @@ void free_pframes()
 
 part_frame::~part_frame()
 {
-  free(data);
+  free(px);
+  free(py);
+  free(pc);
+  free(row_start);
 }
 
 void add_panim(int id, long x, long y, int dir)
 {
   CONDITION(id>=0 && id<total_pseqs,"bad id for particle animation");
-  part_animation *pan=new part_animation(pseqs[id],x,y,dir,NULL);
-  if (!first_anim)
-    first_anim=last_anim=pan;
-  else
+  if (total_panims==panim_size)
   {
-    last_anim->next=pan;
-    last_anim=pan;
+    panim_size=panim_size*2+64;
+    panim_seq=(part_sequence **)realloc(panim_seq,sizeof(part_sequence *)*panim_size);
+    panim_x=(int32_t *)realloc(panim_x,sizeof(int32_t)*panim_size);
+    panim_y=(int32_t *)realloc(panim_y,sizeof(int32_t)*panim_size);
+    panim_frame=(uint16_t *)realloc(panim_frame,sizeof(uint16_t)*panim_size);
+    panim_dir=(int8_t *)realloc(panim_dir,sizeof(int8_t)*panim_size);
   }
+  panim_seq[total_panims]=pseqs[id];
+  panim_x[total_panims]=x;
+  panim_y[total_panims]=y;
+  panim_frame[total_panims]=0;
+  panim_dir[total_panims]=dir>0 ? 1 : -1;
+  total_panims++;
 }
 
 void delete_panims()
 {
-  while (first_anim)
-  {
-    last_anim=first_anim;
-    first_anim=first_anim->next;
-    delete last_anim;
-  }
-  last_anim=NULL;
+  total_panims=0;
 }
 
 int defun_pseq(void *args)
@@ -120,94 +133,120 @@ part_sequence::part_sequence(void *args)
 part_frame::part_frame(bFILE *fp)
 {
   t=fp->read_uint32();
-  data=(part *)malloc(sizeof(part)*t);
+  px=(int16_t *)malloc(sizeof(int16_t)*t);
+  py=(int16_t *)malloc(sizeof(int16_t)*t);
+  pc=(uint8_t *)malloc(t);
   x1=y1=100000; x2=y2=-100000;
   for (int i=0; i<t; i++)
   {
     int16_t x=fp->read_uint16();
     int16_t y=fp->read_uint16();
+    uint8_t color=fp->read_uint8();
+
+    // keep the points sorted by row, the files normally already are
+    int j=i;
+    for (; j>0 && py[j-1]>y; j--)
+    {
+      px[j]=px[j-1];
+      py[j]=py[j-1];
+      pc[j]=pc[j-1];
+    }
+    px[j]=x;
+    py[j]=y;
+    pc[j]=color;
+
     if (x<x1) x1=x;
     if (y<y1) y1=y;
     if (x>x2) x2=x;
-    if (y>y2) y2=x;
-    data[i].x=x;
-    data[i].y=y;
-    data[i].color=fp->read_uint8();
+    if (y>y2) y2=y;
+  }
+
+  int rows=t ? y2-y1+2 : 1;
+  row_start=(int *)malloc(sizeof(int)*rows);
+  for (int r=0,i=0; r<rows; r++)
+  {
+    while (i<t && py[i]<y1+r)
+      i++;
+    row_start[r]=i;
   }
 }
 
 void tick_panims()
 {
-  part_animation *last=NULL;
-  for (part_animation *p=first_anim; p; )
+  int j=0;
+  for (int i=0; i<total_panims; i++)
   {
-    p->frame++;
-    if (p->frame>=p->seq->tframes)
+    int frame=panim_frame[i]+1;
+    if (frame<panim_seq[i]->tframes)
     {
-      if (last)
-        last->next=p->next;
-      else first_anim=first_anim->next;
-      if (last_anim==p) last_anim=last;
-      part_animation *d=p;
-      p=p->next;
-      delete d;
-    } else
-    {
-      last=p;
-      p=p->next;
+      panim_seq[j]=panim_seq[i];
+      panim_x[j]=panim_x[i];
+      panim_y[j]=panim_y[i];
+      panim_frame[j]=frame;
+      panim_dir[j]=panim_dir[i];
+      j++;
     }
-
   }
+  total_panims=j;
 }
 
 void draw_panims(view *v)
 {
-  for (part_animation *p=first_anim; p; p=p->next)
-  {
-    cache.part(p->seq->frames[p->frame])->draw(main_screen,p->x-v->xoff()+v->m_aa.x,p->y-v->yoff()+v->m_aa.y,p->dir);
-  }
+  // current_vxadd is used rather than v->xoff() so that particles follow
+  // the view when it is drawn between two ticks
+  for (int i=0; i<total_panims; i++)
+    cache.part(panim_seq[i]->frames[panim_frame[i]])->draw(main_screen,
+            panim_x[i]-current_vxadd,panim_y[i]-current_vyadd,panim_dir[i]);
 }
 
 void part_frame::draw(image *screen, int x, int y, int dir)
 {
-    ivec2 caa, cbb;
-    screen->GetClip(caa, cbb);
+  if (!t)
+    return;
+
+  ivec2 caa, cbb;
+  screen->GetClip(caa, cbb);
 
-    if (x + x1 >= cbb.x || x + x2 < caa.x || y + y1 >= cbb.y || y + y2 < caa.y)
-       return;
+  // frames facing right are mirrored around x
+  int xs=dir>0 ? -1 : 1;
+  int sx1=dir>0 ? x-x2 : x+x1, sx2=dir>0 ? x-x1 : x+x2;
+  if (sx1>=cbb.x || sx2<caa.x || y+y1>=cbb.y || y+y2<caa.y)
+    return;
 
-  part *pon=data;
-  caa.y -= y;
-  cbb.y -= y;
+  int ry1=Max(y1, caa.y-y), ry2=Min(y2, cbb.y-1-y);
+  int i=row_start[ry1-y1], end=row_start[ry2-y1+1];
 
-  int i=t;
-  while (i && pon->y<caa.y) { pon++; i--; }
-  if (!i) return ;
   screen->Lock();
-  if (dir>0)
+  int pitch=screen->Size().x;
+  uint8_t *base=screen->scan_line(0);
+  int off=y*pitch+x;
+  if (sx1>=caa.x && sx2<cbb.x)
   {
-    while (i && pon->y < cbb.y)
-    {
-      long dx=x-pon->x;
-      if (dx >= caa.x && dx < cbb.x)
-      *(screen->scan_line(pon->y+y)+dx)=pon->color;
-      i--;
-      pon++;
-    }
+    // every column is visible, no need to clip the points
+    for (; i<end; i++)
+      base[off+py[i]*pitch+xs*px[i]]=pc[i];
   } else
   {
-    while (i && pon->y < cbb.y)
+    int cx1=caa.x-x, cx2=cbb.x-x;
+    for (; i<end; i++)
     {
-      long dx=pon->x+x;
-      if (dx >= caa.x && dx < cbb.x)
-        *(screen->scan_line(pon->y+y)+dx)=pon->color;
-      i--;
-      pon++;
+      int dx=xs*px[i];
+      if (dx>=cx1 && dx<cx2)
+        base[off+py[i]*pitch+dx]=pc[i];
     }
   }
   screen->Unlock();
 }
 
+// Both scatter lines read the random table directly and only check the
+// clip per pixel when the line, widened by the scatter, crosses its edge.
+// They use up the same random numbers as before, two per point.
+static int scatter_inside(ivec2 p1, ivec2 p2, int spread, ivec2 caa, ivec2 cbb)
+{
+    return Min(p1.x, p2.x) - spread >= caa.x && Max(p1.x, p2.x) + spread < cbb.x
+        && Min(p1.y, p2.y) - spread >= caa.y && Max(p1.y, p2.y) + spread < cbb.y;
+}
+
 void ScatterLine(ivec2 p1, ivec2 p2, int c, int s)
 {
     ivec2 caa, cbb;
@@ -221,20 +260,23 @@ void ScatterLine(ivec2 p1, ivec2 p2, int c, int s)
 
     int xm = (1 << s);
     int ym = (1 << s);
+    int inside = scatter_inside(p1, p2, xm, caa, cbb);
     s = (15 - s);
 
     main_screen->Lock();
+    int w = main_screen->Size().x;
+    uint8_t *base = main_screen->scan_line(0);
+    unsigned short r = rand_on;
     while(t--)
     {
-        int x = (xo >> 16) + (jrand() >> s) - xm;
-        int y = (yo >> 16) + (jrand() >> s) - ym;
-        if(!(x < caa.x || y < caa.y || x >= cbb.x || y >= cbb.y))
-        {
-            *(main_screen->scan_line(y) + x) = c;
-        }
+        int x = (xo >> 16) + (rtable[r++ & (RAND_TABLE_SIZE - 1)] >> s) - xm;
+        int y = (yo >> 16) + (rtable[r++ & (RAND_TABLE_SIZE - 1)] >> s) - ym;
+        if(inside || !(x < caa.x || y < caa.y || x >= cbb.x || y >= cbb.y))
+            base[y * w + x] = c;
         xo += dx;
         yo += dy;
     }
+    rand_on = r;
     main_screen->Unlock();
 }
 
@@ -251,22 +293,25 @@ void AScatterLine(ivec2 p1, ivec2 p2, int c1, int c2, int s)
 
     int xm = (1 << s);
     int ym = (1 << s);
+    // the cross around each point must stay one pixel inside the clip
+    int inside = scatter_inside(p1, p2, xm + 1, caa, cbb);
     s = (15 - s);
 
     main_screen->Lock();
 
     int w = main_screen->Size().x;
-    uint8_t *addr;
+    uint8_t *base = main_screen->scan_line(0), *addr;
+    unsigned short r = rand_on;
 
     while(t--)
     {
-        int x = (xo >> 16) + (jrand() >> s) - xm;
-        int y = (yo >> 16) + (jrand() >> s) - ym;
+        int x = (xo >> 16) + (rtable[r++ & (RAND_TABLE_SIZE - 1)] >> s) - xm;
+        int y = (yo >> 16) + (rtable[r++ & (RAND_TABLE_SIZE - 1)] >> s) - ym;
         // FIXME: these clip values seemed wrong to me before the GetClip
         // refactoring.
-        if(!(x <= caa.x || y <= caa.y || x >= cbb.x - 1 || y >= cbb.y - 1))
+        if(inside || !(x <= caa.x || y <= caa.y || x >= cbb.x - 1 || y >= cbb.y - 1))
         {
-            addr = main_screen->scan_line(y) + x;
+            addr = base + y * w + x;
             *addr = c1;
             *(addr + w) = c2;
             *(addr - w) = c2;
@@ -276,7 +321,7 @@ void AScatterLine(ivec2 p1, ivec2 p2, int c1, int c2, int s)
         xo += dx;
         yo += dy;
     }
+    rand_on = r;
 
     main_screen->Unlock();
 }
-
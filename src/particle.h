@@ -25,17 +25,15 @@ void free_pframes();
 void ScatterLine(ivec2 p1, ivec2 p2, int c, int s);
 void AScatterLine(ivec2 p1, ivec2 p2, int c1, int c2, int s);
 
-struct part
-{
-  short x,y;
-  uint8_t color;
-} ;
-
+// The points of a frame are sorted by row, with row_start[y-y1] the index
+// of the first point on row y, and stored as separate x, y and color arrays
 class part_frame
 {
   public :
   int t,x1,y1,x2,y2;
-  part *data;
+  int16_t *px,*py;
+  uint8_t *pc;
+  int *row_start;
   part_frame(bFILE *fp);
   void draw(image *screen, int x, int y, int dir);
   ~part_frame();
@@ -50,16 +48,5 @@ class part_sequence
   ~part_sequence() { if (tframes) free(frames); }
 } ;
 
-class part_animation
-{
-  public :
-  part_animation *next;
-  part_sequence *seq;
-  int frame,dir;
-  long x,y;
-  part_animation(part_sequence *s, long X, long Y, int Dir, part_animation *Next)
-  { x=X; y=Y; seq=s; next=Next; frame=0; dir=Dir; }
-} ;
-
 #endif
 
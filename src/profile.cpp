@@ -20,6 +20,7 @@
 #include "jwindow.h"
 #include "property.h"
 #include "objects.h"
+#include "lisp.h"
 
 
 Jwindow *prof_win=NULL;
@@ -61,7 +62,7 @@ void profile_init()
 
   prof_win=wm->CreateWindow(ivec2(prop->getd("profile x", -1),
                                   prop->getd("profile y", -1)),
-                            ivec2(20, prof_height + 1) * console_font->Size(),
+                            ivec2(20, prof_height + 2) * console_font->Size(),
                             NULL, "PROFILE");
 }
 
@@ -109,6 +110,7 @@ static void profile_sort()
 
 void profile_update()
 {
+  double gc_time=Lisp::TakeCollectTime();
   profile_sort();
   if (prof_list[0].total_time<=0.0) return ;     // nothing took any time!
 
@@ -131,5 +133,9 @@ void profile_update()
                           wm->bright_color());
     dy+=console_font->Size().y+1;
   }
+
+  char msg[40];
+  sprintf(msg,"lisp gc %.1f ms",gc_time*1000.0);
+  console_font->PutString(prof_win->m_surf, ivec2(0, dy), msg);
 }
 
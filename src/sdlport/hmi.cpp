@@ -18,6 +18,9 @@
 
 #include "common.h"
 
+#include "specs.h"
+#include "crc.h"
+
 // Load Abuse HMI files and covert them to standard Midi format
 //
 // HMI files differ from Midi files in the following ways:
@@ -41,7 +44,13 @@ struct NoteOffEvent
     uint8_t note;
 };
 
-NoteOffEvent note_off_events[MAX_NOTE_OFF_EVENTS];
+// Pending note-off events, kept sorted by time. Each conversion has its own
+// queue so that songs can be converted from several threads.
+struct NoteOffQueue
+{
+    NoteOffEvent events[MAX_NOTE_OFF_EVENTS];
+    int count;
+};
 
 static uint32_t get_int_from_buffer(uint8_t* buffer)
 {
@@ -57,12 +66,34 @@ static void write_big_endian_number(uint32_t le, uint8_t* buffer)
     buffer[0] = (le & 0xFF000000) >> 24;
 }
 
-static int compare_times(const void* a, const void* b)
+static uint32_t read_big_endian_number(uint8_t const* buffer)
 {
-    NoteOffEvent const *ea = (NoteOffEvent const *)a;
-    NoteOffEvent const *eb = (NoteOffEvent const *)b;
+    return (buffer[0] << 24) + (buffer[1] << 16)
+             + (buffer[2] << 8) + (buffer[3]);
+}
+
+// A cached conversion is only trusted if it is a complete Midi file: an
+// MThd header followed by MTrk chunks that exactly fill the file, so that
+// a truncated or foreign file is converted again.
+static int is_valid_midi(uint8_t const* buffer, uint32_t size)
+{
+    if (size < 14 || memcmp(buffer, "MThd", 4)
+         || read_big_endian_number(&buffer[4]) != 6)
+        return 0;
+
+    uint32_t tracks = (buffer[10] << 8) + buffer[11];
+    uint32_t pos = 14;
+    for (uint32_t i = 0; i < tracks; i++)
+    {
+        if (size - pos < 8 || memcmp(&buffer[pos], "MTrk", 4))
+            return 0;
+        uint32_t length = read_big_endian_number(&buffer[pos + 4]);
+        if (length > size - pos - 8)
+            return 0;
+        pos += 8 + length;
+    }
 
-    return ea->time < eb->time ? -1 : ea->time == eb->time ? 0 : 1;
+    return tracks > 0 && pos == size;
 }
 
 // Variable length number code
@@ -105,48 +136,47 @@ static void write_time_value(uint32_t time, uint8_t* &buffer)
     }
 }
 
-static void remember_note_off_event(uint32_t time, uint8_t cmd, uint8_t note)
+static void remember_note_off_event(NoteOffQueue &queue, uint32_t time,
+                                    uint8_t cmd, uint8_t note)
 {
-    for (int i = 0; i < MAX_NOTE_OFF_EVENTS; i++)
-    {
-        if (note_off_events[i].time == 0xFFFFFFFF)
-        {
-            note_off_events[i].time = time;
-            note_off_events[i].command = cmd;
-            note_off_events[i].note = note;
-            break;
-        }
-    }
+    if (queue.count == MAX_NOTE_OFF_EVENTS)
+        return;
 
-    // Sort the note off array by the time
-    qsort(note_off_events, MAX_NOTE_OFF_EVENTS, sizeof(NoteOffEvent), compare_times);
+    // Insert after any event with the same time
+    int i = queue.count++;
+    for ( ; i > 0 && queue.events[i - 1].time > time; i--)
+        queue.events[i] = queue.events[i - 1];
+
+    queue.events[i].time = time;
+    queue.events[i].command = cmd;
+    queue.events[i].note = note;
 }
 
-static void check_for_note_off_events(uint32_t &current_time,
+static void check_for_note_off_events(NoteOffQueue &queue,
+                                      uint32_t &current_time,
                                       uint32_t &last_time, uint8_t* &buffer)
 {
-    for (int i = 0; i < MAX_NOTE_OFF_EVENTS; i++)
+    int done = 0;
+    while (done < queue.count && queue.events[done].time < current_time)
     {
-        if (note_off_events[i].time == 0xFFFFFFFF)
-            break;
-
-        if (note_off_events[i].time < current_time)
-        {
-            // Add event
-            write_time_value(note_off_events[i].time - last_time, buffer);
-            last_time = note_off_events[i].time;
+        NoteOffEvent &ev = queue.events[done++];
 
-            *buffer++ = note_off_events[i].command;
-            *buffer++ = note_off_events[i].note;
-            *buffer++ = 0x00;
+        // Add event
+        write_time_value(ev.time - last_time, buffer);
+        last_time = ev.time;
 
-            // Remove event from queue
-            note_off_events[i].time = 0xFFFFFFFF;
-        }
+        *buffer++ = ev.command;
+        *buffer++ = ev.note;
+        *buffer++ = 0x00;
     }
 
-    // Sort the note off array by the time
-    qsort(note_off_events, MAX_NOTE_OFF_EVENTS, sizeof(NoteOffEvent), compare_times);
+    // Remove the events from the queue
+    if (done)
+    {
+        queue.count -= done;
+        memmove(queue.events, queue.events + done,
+                queue.count * sizeof(NoteOffEvent));
+    }
 }
 
 static void convert_hmi_track(uint8_t* input,
@@ -160,7 +190,8 @@ static void convert_hmi_track(uint8_t* input,
     uint8_t* start_of_buffer = output;
     uint8_t* start_of_input = input;
 
-    memset(note_off_events, 0xFF, sizeof(NoteOffEvent) * MAX_NOTE_OFF_EVENTS);
+    NoteOffQueue queue;
+    queue.count = 0;
 
     // Midi data offset is at 0x57 from track start
     input += input[0x57];
@@ -185,7 +216,7 @@ static void convert_hmi_track(uint8_t* input,
         }
 
         // Check if note off events have to be inserted here
-        check_for_note_off_events(current_time, last_time, output);
+        check_for_note_off_events(queue, current_time, last_time, output);
 
         if (current_command != 0xFE)
         {
@@ -219,7 +250,7 @@ static void convert_hmi_track(uint8_t* input,
         case 0x90: // Note on, non-standard, HMI files specify the duration as a third param
             *output++ = current_value;
             *output++ = *input++;
-            remember_note_off_event(current_time + read_time_value(input), current_command, current_value);
+            remember_note_off_event(queue, current_time + read_time_value(input), current_command, current_value);
             break;
 
         case 0xF0: // Meta event
@@ -289,6 +320,31 @@ uint8_t* load_hmi(char const *filename, uint32_t &data_size)
     fread(input_buffer, 1, buffersize, hmifile);
     fclose(hmifile);
 
+    // Converted files are cached in the save directory, keyed by CRC
+    char cachename[255];
+    snprintf(cachename, sizeof(cachename), "%smidi%04x%08x.mid",
+             get_save_filename_prefix(), calc_crc(input_buffer, buffersize),
+             buffersize);
+
+    FILE* cachefile = fopen(cachename, "rb");
+    if (cachefile != NULL)
+    {
+        fseek(cachefile, 0, SEEK_END);
+        data_size = ftell(cachefile);
+        fseek(cachefile, 0, SEEK_SET);
+
+        output_buffer = (uint8_t*)malloc(data_size);
+        uint32_t got = fread(output_buffer, 1, data_size, cachefile);
+        fclose(cachefile);
+
+        if (got == data_size && is_valid_midi(output_buffer, data_size))
+        {
+            free(input_buffer);
+            return output_buffer;
+        }
+        free(output_buffer);
+    }
+
     output_buffer = (uint8_t*)malloc(buffersize * 10); // Midi files can be larger than HMI files
     uint8_t* output_buffer_ptr = output_buffer;
 
@@ -325,6 +381,18 @@ uint8_t* load_hmi(char const *filename, uint32_t &data_size)
 
     free(input_buffer);
 
+    cachefile = fopen(cachename, "wb");
+    if (cachefile != NULL)
+    {
+        if (fwrite(output_buffer, 1, data_size, cachefile) != data_size)
+        {
+            fclose(cachefile);
+            remove(cachename);
+        }
+        else
+            fclose(cachefile);
+    }
+
     return output_buffer;
 }
 
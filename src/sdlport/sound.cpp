@@ -24,9 +24,15 @@
 
 #include <cstring>
 
+#if defined HAVE_SYS_MMAN_H
+#   include <sys/mman.h>
+#endif
+
 #include <SDL.h>
 #include <SDL/SDL_mixer.h>
 
+#include "common.h"
+
 #include "sound.h"
 #include "hmi.h"
 #include "specs.h"
@@ -36,6 +42,126 @@ extern flags_struct flags;
 static int sound_enabled = 0;
 static SDL_AudioSpec audioObtained;
 
+// Only one song is converted at a time, see song::load_thread()
+static SDL_mutex *song_load_lock = NULL;
+
+// Sound effects preconverted by "abuse-tool sfxbank". The samples are used
+// in place, so the whole file stays mapped until sound_uninit().
+static spec_directory *sfx_bank = NULL;
+static uint8_t *sfx_bank_data = NULL;
+static long sfx_bank_size = 0;
+static int sfx_bank_mapped = 0;
+
+//
+// sfx_bank_open()
+// Map the sound bank, if there is one
+//
+static void sfx_bank_open(char const *datadir)
+{
+    char *name = (char *)malloc(strlen(datadir) + 12 + 1);
+    sprintf(name, "%s/sfxbank.spe", datadir);
+    FILE *f = fopen(name, "rb");
+    free(name);
+    if (!f)
+        return;
+
+    sfx_bank = new spec_directory(f);
+    fseek(f, 0, SEEK_END);
+    sfx_bank_size = ftell(f);
+
+#if defined HAVE_SYS_MMAN_H
+    void *map = mmap(NULL, sfx_bank_size, PROT_READ, MAP_SHARED, fileno(f), 0);
+    if (map != MAP_FAILED)
+    {
+        sfx_bank_data = (uint8_t *)map;
+        sfx_bank_mapped = 1;
+    }
+#endif
+    if (!sfx_bank_data)
+    {
+        // No mmap() on this platform: still a single read for all effects
+        sfx_bank_data = (uint8_t *)malloc(sfx_bank_size);
+        fseek(f, 0, SEEK_SET);
+        if (fread(sfx_bank_data, 1, sfx_bank_size, f) != (size_t)sfx_bank_size)
+        {
+            free(sfx_bank_data);
+            sfx_bank_data = NULL;
+        }
+    }
+    fclose(f);
+
+    if (!sfx_bank_data || !sfx_bank->total)
+    {
+        printf("Sound: ignoring unreadable sound bank\n");
+        delete sfx_bank;
+        sfx_bank = NULL;
+        return;
+    }
+
+    printf("Sound: using sound bank (%d effects)\n", sfx_bank->total);
+}
+
+static void sound_forget(sound_effect *effect);
+
+static void sfx_bank_close()
+{
+    if (!sfx_bank)
+        return;
+
+#if defined HAVE_SYS_MMAN_H
+    if (sfx_bank_mapped)
+        munmap(sfx_bank_data, sfx_bank_size);
+    else
+#endif
+        free(sfx_bank_data);
+    sfx_bank_data = NULL;
+    delete sfx_bank;
+    sfx_bank = NULL;
+}
+
+//
+// sfx_bank_chunk()
+// Create a chunk pointing into the bank, or return NULL if the effect is
+// not in the bank or was not converted to the current mixer format.
+//
+static Mix_Chunk *sfx_bank_chunk(char const *filename)
+{
+    if (!sfx_bank)
+        return NULL;
+
+    spec_entry *se = sfx_bank->find(filename, SPEC_SFX_PCM);
+    if (!se || se->size < SFX_PCM_HEADER_SIZE
+         || se->offset + se->size > (unsigned long)sfx_bank_size)
+        return NULL;
+
+    uint8_t *p = sfx_bank_data + se->offset;
+    uint32_t rate, data_offset, data_size;
+    uint16_t format, channels;
+    memcpy(&rate, p, 4);
+    memcpy(&format, p + 4, 2);
+    memcpy(&channels, p + 6, 2);
+    memcpy(&data_offset, p + 8, 4);
+    memcpy(&data_size, p + 12, 4);
+    rate = lltl(rate);
+    format = lstl(format);
+    channels = lstl(channels);
+    data_offset = lltl(data_offset);
+    data_size = lltl(data_size);
+
+    if ((int)rate != audioObtained.freq || format != audioObtained.format
+         || channels != audioObtained.channels
+         || data_offset + data_size > se->size)
+        return NULL;
+
+    // allocated = 0 tells Mix_FreeChunk() not to free the samples
+    Mix_Chunk *chunk = (Mix_Chunk *)malloc(sizeof(Mix_Chunk));
+    chunk->allocated = 0;
+    chunk->abuf = p + data_offset;
+    chunk->alen = data_size;
+    chunk->volume = MIX_MAX_VOLUME;
+    return chunk;
+}
+
 //
 // sound_init()
 // Initialise audio
@@ -72,12 +198,18 @@ int sound_init( int argc, char **argv )
         return 0;
     }
 
-    Mix_AllocateChannels(50);
+    Mix_AllocateChannels(SOUND_CHANNELS);
+    // Channels 0 to SOUND_VOICES-1 are only used by sound_flush()
+    Mix_ReserveChannels(SOUND_VOICES);
 
     int tempChannels = 0;
     Mix_QuerySpec(&audioObtained.freq, &audioObtained.format, &tempChannels);
     audioObtained.channels = tempChannels & 0xFF;
 
+    sfx_bank_open(datadir);
+
+    song_load_lock = SDL_CreateMutex();
+
     sound_enabled = SFX_INITIALIZED | MUSIC_INITIALIZED;
 
     printf( "Sound: Enabled\n" );
@@ -97,18 +229,29 @@ void sound_uninit()
         return;
 
     Mix_CloseAudio();
+    sfx_bank_close();
+
+    SDL_DestroyMutex(song_load_lock);
+    song_load_lock = NULL;
 }
 
 //
 // sound_effect constructor
 //
-// Read in the requested .wav file.
+// Use the preconverted samples from the sound bank, or read in the
+// requested .wav file.
 //
 sound_effect::sound_effect(char const *filename)
 {
+    m_chunk = NULL;
+
     if (!sound_enabled)
         return;
 
+    m_chunk = sfx_bank_chunk(filename);
+    if (m_chunk)
+        return;
+
     jFILE fp(filename, "rb");
     if (fp.open_failure())
         return;
@@ -140,6 +283,8 @@ sound_effect::~sound_effect()
     while (Mix_Playing(-1))
         SDL_Delay(10);
     Mix_FreeChunk(m_chunk);
+
+    sound_forget(this);
 }
 
 //
@@ -151,12 +296,12 @@ sound_effect::~sound_effect()
 //   128 - Centered.
 //   255 - Completely to the left.
 //
-void sound_effect::play(int volume, int pitch, int panpot)
+int sound_effect::play(int volume, int pitch, int panpot, int channel)
 {
-    if (!sound_enabled)
-        return;
+    if (!sound_enabled || !m_chunk)
+        return -1;
 
-    int channel = Mix_PlayChannel(-1, m_chunk, 0);
+    channel = Mix_PlayChannel(channel, m_chunk, 0);
     if (channel > -1)
     {
         Mix_Volume(channel, volume);
@@ -167,77 +312,332 @@ void sound_effect::play(int volume, int pitch, int panpot)
         Mix_SetPanning(channel, panpot, 255 - panpot);
 #endif
     }
+    return channel;
+}
+
+//
+// Positional sound scheduler
+//
+// In big fights dozens of identical effects get requested during the same
+// tick. Instead of letting each of them grab a mixer channel, requests are
+// merged by effect and position, then the loudest ones are started on the
+// channels reserved for positional effects, stealing the least audible
+// voice when they are all busy.
+//
+
+#define SOUND_MAX_PENDING     64
+#define SOUND_RETRIGGER_TICKS 2   // a nearby voice this recent absorbs requests
+#define SOUND_AGE_PENALTY     8   // volume a voice loses per tick when stealing
+
+struct sound_request
+{
+    sound_effect *effect;
+    int volume, panpot;
+    int32_t x, y;
+};
+
+struct sound_voice
+{
+    sound_effect *effect;
+    int volume;
+    int32_t x, y;
+    unsigned long start;
+};
+
+static sound_request pending[SOUND_MAX_PENDING];
+static int total_pending = 0;
+static sound_voice voices[SOUND_VOICES];
+static unsigned long sound_ticks = 0;
+
+static int near_enough(int32_t x1, int32_t y1, int32_t x2, int32_t y2)
+{
+    return abs(x1 - x2) + abs(y1 - y2) < SOUND_MERGE_DIST;
+}
+
+void sound_queue(sound_effect *effect, int volume, int panpot,
+                 int32_t x, int32_t y)
+{
+    if (!sound_enabled || !effect)
+        return;
+
+    int quietest = -1;
+    for (int i = 0; i < total_pending; i++)
+    {
+        sound_request *r = pending + i;
+        if (r->effect == effect && near_enough(r->x, r->y, x, y))
+        {
+            if (volume > r->volume)
+            {
+                r->volume = volume;
+                r->panpot = panpot;
+            }
+            return;
+        }
+        if (quietest < 0 || r->volume < pending[quietest].volume)
+            quietest = i;
+    }
+
+    sound_request *r;
+    if (total_pending < SOUND_MAX_PENDING)
+        r = pending + total_pending++;
+    else if (pending[quietest].volume < volume)
+        r = pending + quietest;
+    else
+        return;
+
+    r->effect = effect;
+    r->volume = volume;
+    r->panpot = panpot;
+    r->x = x;
+    r->y = y;
+}
+
+static int request_compare(void const *a, void const *b)
+{
+    return ((sound_request const *)b)->volume
+            - ((sound_request const *)a)->volume;
+}
+
+void sound_flush()
+{
+    song::flush_pending();
+
+    sound_ticks++;
+    if (!total_pending)
+        return;
+
+    qsort(pending, total_pending, sizeof(sound_request), request_compare);
+
+    int started = 0;
+    for (int i = 0; i < total_pending && started < SOUND_STARTS_PER_TICK; i++)
+    {
+        sound_request *r = pending + i;
+
+        // An identical effect that just started nearby covers this one
+        int c, victim = -1, victim_score = 0;
+        for (c = 0; c < SOUND_VOICES; c++)
+        {
+            sound_voice *v = voices + c;
+            if (!Mix_Playing(c))
+                break;
+            if (v->effect == r->effect
+                 && sound_ticks - v->start <= SOUND_RETRIGGER_TICKS
+                 && near_enough(v->x, v->y, r->x, r->y))
+                break;
+
+            int score = v->volume
+                      - (int)(sound_ticks - v->start) * SOUND_AGE_PENALTY;
+            if (victim < 0 || score < victim_score)
+            {
+                victim = c;
+                victim_score = score;
+            }
+        }
+
+        if (c < SOUND_VOICES && Mix_Playing(c))
+        {
+            if (r->volume > voices[c].volume)
+            {
+                Mix_Volume(c, r->volume);
+                voices[c].volume = r->volume;
+            }
+            continue;
+        }
+
+        if (c == SOUND_VOICES)
+        {
+            // All voices busy: only steal one that is less audible
+            if (victim_score >= r->volume)
+                continue;
+            c = victim;
+        }
+
+        if (r->effect->play(r->volume, 128, r->panpot, c) < 0)
+            continue;
+
+        voices[c].effect = r->effect;
+        voices[c].volume = r->volume;
+        voices[c].x = r->x;
+        voices[c].y = r->y;
+        voices[c].start = sound_ticks;
+        started++;
+    }
+
+    total_pending = 0;
+}
+
+//
+// sound_forget
+//
+// Drop any reference to an effect that is being deleted.
+//
+static void sound_forget(sound_effect *effect)
+{
+    for (int i = 0; i < total_pending; )
+    {
+        if (pending[i].effect == effect)
+            pending[i] = pending[--total_pending];
+        else
+            i++;
+    }
+
+    for (int c = 0; c < SOUND_VOICES; c++)
+        if (voices[c].effect == effect)
+            voices[c].effect = NULL;
 }
 
 
 // Play music using SDL_Mixer
+//
+// Songs are converted by a loader thread so that level changes do not stall
+// on the HMI conversion. SDL_Mixer itself is only called from the main
+// thread: a play() request that arrives before the song is ready is
+// remembered and started by sound_flush() once the loader is done.
+
+static song *waiting_song = NULL;
 
 song::song(char const * filename)
 {
     data = NULL;
+    data_size = 0;
     Name = strdup(filename);
     song_id = 0;
 
     rw = NULL;
     music = NULL;
 
+    loaded = 0;
+    play_pending = 0;
+    pending_volume = 127;
+
+    lock = SDL_CreateMutex();
+    loader = SDL_CreateThread(load_thread, this);
+
+    // No thread support, load the song right away
+    if (!loader)
+        load_thread(this);
+}
+
+// Runs on the loader thread: only the conversion and the cache file I/O
+int song::load_thread(void *arg)
+{
+    song *me = (song *)arg;
+
     char realname[255];
     strcpy(realname, get_filename_prefix());
-    strcat(realname, filename);
+    strcat(realname, me->Name);
+
+    if (song_load_lock)
+        SDL_mutexP(song_load_lock);
 
     uint32_t data_size;
-    data = load_hmi(realname, data_size);
+    uint8_t *data = load_hmi(realname, data_size);
+
+    if (song_load_lock)
+        SDL_mutexV(song_load_lock);
 
     if (!data)
-    {
         printf("Sound: ERROR - could not load %s\n", realname);
-        return;
-    }
 
-    rw = SDL_RWFromMem(data, data_size);
-    music = Mix_LoadMUS_RW(rw);
+    SDL_mutexP(me->lock);
+    me->data = data;
+    me->data_size = data ? data_size : 0;
+    me->loaded = 1;
+    SDL_mutexV(me->lock);
+
+    return 0;
+}
+
+// Hand the converted song to SDL_Mixer, on the main thread. Returns
+// nonzero once the loader is done, whether or not the song is playable.
+int song::finish_load()
+{
+    SDL_mutexP(lock);
+    int done = loaded;
+    SDL_mutexV(lock);
+
+    if (!done)
+        return 0;
 
-    if (!music)
+    if (data && !rw)
     {
-        printf("Sound: ERROR - %s while loading %s\n",
-               Mix_GetError(), realname);
+        rw = SDL_RWFromMem(data, data_size);
+        music = Mix_LoadMUS_RW(rw);
+
+        if (!music)
+            printf("Sound: ERROR - %s while loading %s\n",
+                   Mix_GetError(), Name);
+    }
+
+    return 1;
+}
+
+void song::flush_pending()
+{
+    song *me = waiting_song;
+    if (!me || !me->finish_load())
         return;
+
+    waiting_song = NULL;
+    if (me->play_pending && me->music)
+    {
+        Mix_PlayMusic(me->music, 0);
+        Mix_VolumeMusic(me->pending_volume);
     }
+    me->play_pending = 0;
 }
 
 song::~song()
 {
+    if (loader)
+        SDL_WaitThread(loader, NULL);
+    if (waiting_song == this)
+        waiting_song = NULL;
+
     if(playing())
         stop();
     free(data);
     free(Name);
 
-    Mix_FreeMusic(music);
-    SDL_FreeRW(rw);
+    if (music)
+        Mix_FreeMusic(music);
+    if (rw)
+        SDL_FreeRW(rw);
+    SDL_DestroyMutex(lock);
 }
 
 void song::play( unsigned char volume )
 {
     song_id = 1;
 
-    Mix_PlayMusic(this->music, 0);
-    Mix_VolumeMusic(volume);
+    if (!finish_load())
+    {
+        play_pending = 1;
+        pending_volume = volume;
+        waiting_song = this;
+    }
+    else if (music)
+    {
+        Mix_PlayMusic(this->music, 0);
+        Mix_VolumeMusic(volume);
+    }
 }
 
 void song::stop( long fadeout_time )
 {
     song_id = 0;
+    play_pending = 0;
 
     Mix_FadeOutMusic(100);
 }
 
 int song::playing()
 {
-    return Mix_PlayingMusic();
+    return play_pending || Mix_PlayingMusic();
 }
 
 void song::set_volume( int volume )
 {
+    pending_volume = volume;
     Mix_VolumeMusic(volume);
 }
-
@@ -20,17 +20,33 @@
 #define SFX_INITIALIZED    1
 #define MUSIC_INITIALIZED  2
 
+#define SOUND_CHANNELS        50  // total mixer channels
+#define SOUND_VOICES          16  // channels reserved for positional effects
+#define SOUND_STARTS_PER_TICK 8   // positional effects started per tick
+#define SOUND_MERGE_DIST      64  // same effects closer than this are merged
+
+class sound_effect;
+
 int sound_init(int argc, char **argv);
 void sound_uninit();
 void print_sound_options(); // print the options avaible for sound
 
+// Positional effects requested during a tick are merged, ranked by volume
+// and started together by sound_flush(), within the voice budget. It also
+// starts a song whose play() request came before it finished loading.
+void sound_queue(sound_effect *effect, int volume, int panpot,
+                 int32_t x, int32_t y);
+void sound_flush();
+
 class sound_effect
 {
 public:
     sound_effect(char const *filename);
     ~sound_effect();
 
-    void play(int volume = 127, int pitch = 128, int panpot = 128);
+    // returns the channel used, or -1 if the effect could not be played
+    int play(int volume = 127, int pitch = 128, int panpot = 128,
+             int channel = -1);
 
 private:
 #if !defined __CELLOS_LV2__
@@ -51,6 +67,9 @@ public:
     void set_volume(int volume);
     ~song();
 
+    // Start a pending song once its loader is done, see sound_flush()
+    static void flush_pending();
+
 private:
 #if !defined __CELLOS_LV2__
     char *Name;
@@ -58,6 +77,15 @@ private:
     unsigned long song_id;
     Mix_Music* music;
     SDL_RWops* rw;
+
+    // Background loading, see song::load_thread()
+    static int load_thread(void *arg);
+    int finish_load();
+    SDL_Thread *loader;
+    SDL_mutex *lock;
+    uint32_t data_size;
+    int loaded, play_pending;
+    unsigned char pending_volume;
 #endif
 };
 
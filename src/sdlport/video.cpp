@@ -63,7 +63,14 @@ GLuint texid;
 SDL_Surface *texture = NULL;
 #endif
 
-static void update_window_part(SDL_Rect *rect);
+// When the window (or the OpenGL texture) is 16 or 32-bit, its pixels are
+// written straight from the 8-bit image through rgb_table, at the same time
+// as the 8-bit surface, instead of through a second SDL_BlitSurface pass.
+// The surface is still kept, so palette changes can redraw the window.
+static SDL_Surface *rgb_target = NULL;
+static Uint32 rgb_table[256];
+
+static void update_window_part(SDL_Rect *rect, int converted = 0);
 
 //
 // power_of_two()
@@ -224,6 +231,14 @@ void set_mode(int mode, int argc, char **argv)
         exit(1);
     }
 
+#ifdef HAVE_OPENGL
+    if (flags.gl)
+        rgb_target = texture;
+    else
+#endif
+    if (window->format->BytesPerPixel == 2 || window->format->BytesPerPixel == 4)
+        rgb_target = window;
+
     printf("Video : %dx%d %dbpp\n", window->w, window->h, window->format->BitsPerPixel);
 
     // Set the window caption
@@ -249,6 +264,7 @@ void close_graphics()
     // Free our 8-bit surface
     if(surface)
         SDL_FreeSurface(surface);
+    rgb_target = NULL;
 
 #ifdef HAVE_OPENGL
     if (texture)
@@ -257,6 +273,55 @@ void close_graphics()
     delete main_screen;
 }
 
+//
+// convert_line()
+// Write count pixels of 8-bit data in the format of rgb_target
+//
+static inline void convert_line(Uint8 *dst, Uint8 const *src, int count)
+{
+    if (rgb_target->format->BytesPerPixel == 4)
+    {
+        Uint32 *d = (Uint32 *)dst;
+        for (int i = 0; i < count; i++)
+            d[i] = rgb_table[src[i]];
+    }
+    else
+    {
+        Uint16 *d = (Uint16 *)dst;
+        for (int i = 0; i < count; i++)
+            d[i] = (Uint16)rgb_table[src[i]];
+    }
+}
+
+//
+// convert_rect()
+// Redraw part of rgb_target from the 8-bit surface, all of it if rect is NULL
+//
+static void convert_rect(SDL_Rect *rect)
+{
+    int x = 0, y = 0, w = surface->w, h = surface->h;
+    if (rect)
+    {
+        x = rect->x; y = rect->y; w = rect->w; h = rect->h;
+    }
+    w = Min(w, rgb_target->w - x);
+    h = Min(h, rgb_target->h - y);
+    if (w <= 0 || h <= 0)
+        return;
+
+    int bpp = rgb_target->format->BytesPerPixel;
+
+    if (SDL_MUSTLOCK(rgb_target))
+        SDL_LockSurface(rgb_target);
+
+    for (int i = 0; i < h; i++)
+        convert_line((Uint8 *)rgb_target->pixels + (y + i) * rgb_target->pitch + x * bpp,
+                     (Uint8 *)surface->pixels + (y + i) * surface->pitch + x, w);
+
+    if (SDL_MUSTLOCK(rgb_target))
+        SDL_UnlockSurface(rgb_target);
+}
+
 // put_part_image()
 // Draw only dirty parts of the image
 //
@@ -322,7 +387,39 @@ void put_part_image(image *im, int x, int y, int x1, int y1, int x2, int y2)
     dpixel += (dstrect.x + ((dstrect.y) * surface->w)) * surface->format->BytesPerPixel;
 
     // Update surface part
-    if ((win_xscale==1<<16) && (win_yscale==1<<16)) // no scaling or hw scaling
+    if ((win_xscale==1<<16) && (win_yscale==1<<16) && rgb_target)
+    {
+        // Fill the surface and the window or texture from the same reads
+        int bpp = rgb_target->format->BytesPerPixel;
+        int tw = Min((int)srcrect.w, rgb_target->w - x);
+        int th = Min((int)srcrect.h, rgb_target->h - y);
+
+        if(SDL_MUSTLOCK(rgb_target))
+            SDL_LockSurface(rgb_target);
+
+        srcy = srcrect.y;
+        dpixel = ((Uint8 *)surface->pixels) + y * surface->pitch + x;
+        Uint8 *tpixel = (Uint8 *)rgb_target->pixels + y * rgb_target->pitch + x * bpp;
+        for(ii=0 ; ii < srcrect.h; ii++)
+        {
+            Uint8 *sl = im->scan_line(srcy) + srcrect.x;
+            memcpy(dpixel, sl, srcrect.w);
+            if(ii < th && tw > 0)
+                convert_line(tpixel, sl, tw);
+            dpixel += surface->pitch;
+            tpixel += rgb_target->pitch;
+            srcy ++;
+        }
+
+        if(SDL_MUSTLOCK(rgb_target))
+            SDL_UnlockSurface(rgb_target);
+        if(SDL_MUSTLOCK(surface))
+            SDL_UnlockSurface(surface);
+
+        update_window_part(&dstrect, 1);
+        return;
+    }
+    else if ((win_xscale==1<<16) && (win_yscale==1<<16)) // no scaling or hw scaling
     {
         srcy = srcrect.y;
         dpixel = ((Uint8 *)surface->pixels) + y * surface->w + x ;
@@ -390,6 +487,10 @@ void palette::load()
         colors[ii].b = blue(ii);
     }
     SDL_SetColors(surface, colors, 0, ncolors);
+    if(rgb_target)
+        for(int ii = 0; ii < ncolors; ii++)
+            rgb_table[ii] = SDL_MapRGB(rgb_target->format, colors[ii].r,
+                                       colors[ii].g, colors[ii].b);
     if(window->format->BitsPerPixel == 8)
         SDL_SetColors(window, colors, 0, ncolors);
 
@@ -414,9 +515,7 @@ void update_window_done()
     // opengl blit complete surface to window
     if(flags.gl)
     {
-        // convert color-indexed surface to RGB texture
-        SDL_BlitSurface(surface, NULL, texture, NULL);
-
+        // the texture was filled along with the color-indexed surface
         // Texturemap complete texture to surface so we have free scaling
         // and antialiasing
         glTexSubImage2D(GL_TEXTURE_2D, 0,
@@ -440,14 +539,19 @@ void update_window_done()
 #endif
 }
 
-static void update_window_part(SDL_Rect *rect)
+static void update_window_part(SDL_Rect *rect, int converted)
 {
+    // put_part_image() may already have written the window or texture
+    if (rgb_target && !converted)
+        convert_rect(rect);
+
     // no partial blit's in case of opengl
-    // complete blit + scaling just before flip
+    // complete upload + scaling just before flip
     if (flags.gl)
         return;
 
-    SDL_BlitSurface(surface, rect, window, rect);
+    if (!rgb_target)
+        SDL_BlitSurface(surface, rect, window, rect);
 
     // no window update needed until end of run
     if(flags.doublebuf)
@@ -22,6 +22,8 @@
 #include "crc.h"
 
 static void Usage();
+static uint8_t *ConvertWav(char const *name, int rate, int channels,
+                           int bigendian, size_t &len);
 
 enum
 {
@@ -35,6 +37,7 @@ enum
     CMD_TYPE,
     CMD_GETPCX,
     CMD_PUTPCX,
+    CMD_SFXBANK,
 };
 
 #if ((defined(__wii__) || defined(__gamecube__)) && !defined(main))
@@ -59,6 +62,7 @@ int main(int argc, char *argv[])
             : !strcmp(argv[2], "type") ? CMD_TYPE
             : !strcmp(argv[2], "getpcx") ? CMD_GETPCX
             : !strcmp(argv[2], "putpcx") ? CMD_PUTPCX
+            : !strcmp(argv[2], "sfxbank") ? CMD_SFXBANK
             : CMD_INVALID;
 
     if (cmd == CMD_INVALID)
@@ -102,6 +106,9 @@ int main(int argc, char *argv[])
     case CMD_PUTPCX:
         minargc = 6;
         break;
+    case CMD_SFXBANK:
+        minargc = 7;
+        break;
     }
 
     if (argc < minargc)
@@ -111,6 +118,78 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    /* The sound bank is always written from scratch */
+    if (cmd == CMD_SFXBANK)
+    {
+        int rate = atoi(argv[3]);
+        int channels = atoi(argv[4]);
+        int bigendian = !strcmp(argv[5], "s16be") ? 1
+                      : !strcmp(argv[5], "s16le") ? 0
+                      : !strcmp(argv[5], "s16") ? BigEndian() : -1;
+
+        if (rate <= 0 || channels < 1 || channels > 2 || bigendian < 0)
+        {
+            fprintf(stderr, "abuse-tool: invalid sound format %s %s %s\n",
+                    argv[3], argv[4], argv[5]);
+            return EXIT_FAILURE;
+        }
+
+        spec_directory dir;
+        for (int i = 6; i < argc; i++)
+        {
+            size_t len;
+            uint8_t *pcm = ConvertWav(argv[i], rate, channels, bigendian, len);
+            if (!pcm)
+                return EXIT_FAILURE;
+            spec_entry *se = new spec_entry(SPEC_SFX_PCM, argv[i], NULL,
+                                            SFX_PCM_HEADER_SIZE + len, 0);
+            se->data = pcm;
+            dir.add_by_hand(se);
+        }
+
+        /* Pad each entry so that its samples are aligned in the file, which
+         * lets the game use them directly from a memory mapping. */
+        dir.calc_offsets();
+        unsigned long o = dir.data_start_offset();
+        for (int i = 0; i < dir.total; i++)
+        {
+            spec_entry *se = dir.entries[i];
+            size_t len = se->size - SFX_PCM_HEADER_SIZE;
+            size_t pad = (SFX_PCM_ALIGN - (o + SFX_PCM_HEADER_SIZE)
+                                            % SFX_PCM_ALIGN) % SFX_PCM_ALIGN;
+            uint8_t *data = (uint8_t *)malloc(SFX_PCM_HEADER_SIZE + pad + len);
+            uint32_t rate32 = lltl(rate);
+            uint16_t format = lstl(bigendian ? SFX_PCM_S16MSB : SFX_PCM_S16LSB);
+            uint16_t chan16 = lstl(channels);
+            uint32_t offset32 = lltl(SFX_PCM_HEADER_SIZE + pad);
+            uint32_t len32 = lltl(len);
+            memcpy(data, &rate32, 4);
+            memcpy(data + 4, &format, 2);
+            memcpy(data + 6, &chan16, 2);
+            memcpy(data + 8, &offset32, 4);
+            memcpy(data + 12, &len32, 4);
+            memset(data + SFX_PCM_HEADER_SIZE, 0, pad);
+            memcpy(data + SFX_PCM_HEADER_SIZE + pad, se->data, len);
+            free(se->data);
+            se->data = data;
+            se->size = SFX_PCM_HEADER_SIZE + pad + len;
+            o += se->size;
+        }
+        dir.calc_offsets();
+
+        remove(argv[1]);
+        jFILE fp(argv[1], "wb");
+        if (fp.open_failure() || !dir.write(&fp))
+        {
+            fprintf(stderr, "ERROR - could not write %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        for (int i = 0; i < dir.total; i++)
+            fp.write(dir.entries[i]->data, dir.entries[i]->size);
+
+        return EXIT_SUCCESS;
+    }
+
     /* Open the SPEC file */
     char tmpfile[4096];
     char const *file = argv[1];
@@ -379,6 +458,115 @@ int main(int argc, char *argv[])
     return EXIT_SUCCESS;
 }
 
+//
+// Load a PCM .wav file and convert it to signed 16-bit samples at the
+// requested rate and channel count, using linear interpolation.
+//
+static uint8_t *ConvertWav(char const *name, int rate, int channels,
+                           int bigendian, size_t &len)
+{
+    jFILE fp(name, "rb");
+    if (fp.open_failure())
+    {
+        fprintf(stderr, "abuse-tool: cannot open %s\n", name);
+        return NULL;
+    }
+
+    char tag[4];
+    fp.read(tag, 4);
+    fp.read_uint32();
+    char wave[4];
+    fp.read(wave, 4);
+    if (memcmp(tag, "RIFF", 4) || memcmp(wave, "WAVE", 4))
+    {
+        fprintf(stderr, "abuse-tool: %s is not a WAV file\n", name);
+        return NULL;
+    }
+
+    int src_format = 0, src_channels = 0, src_rate = 0, src_bits = 0;
+    uint8_t *src = NULL;
+    uint32_t src_size = 0;
+
+    while (fp.read(tag, 4) == 4)
+    {
+        uint32_t size = fp.read_uint32();
+        long next = fp.tell() + size + (size & 1);
+
+        if (!memcmp(tag, "fmt ", 4))
+        {
+            src_format = fp.read_uint16();
+            src_channels = fp.read_uint16();
+            src_rate = fp.read_uint32();
+            fp.read_uint32(); // bytes per second
+            fp.read_uint16(); // block align
+            src_bits = fp.read_uint16();
+        }
+        else if (!memcmp(tag, "data", 4) && !src)
+        {
+            src = (uint8_t *)malloc(size);
+            src_size = fp.read(src, size);
+        }
+        fp.seek(next, SEEK_SET);
+    }
+
+    if (!src || src_format != 1 || src_channels < 1 || src_channels > 2
+         || src_rate <= 0 || (src_bits != 8 && src_bits != 16))
+    {
+        fprintf(stderr, "abuse-tool: %s is not a supported PCM file\n", name);
+        free(src);
+        return NULL;
+    }
+
+    /* Decode to 16-bit host-endian frames */
+    int frame_size = src_channels * src_bits / 8;
+    int frames = src_size / frame_size;
+    int16_t *in = (int16_t *)malloc((frames + 1) * src_channels * sizeof(int16_t));
+    for (int i = 0; i < frames * src_channels; i++)
+    {
+        if (src_bits == 8)
+            in[i] = (int16_t)((src[i] - 128) << 8);
+        else
+            in[i] = (int16_t)(src[i * 2] | (src[i * 2 + 1] << 8));
+    }
+    /* Duplicate the last frame so interpolation never reads past the end */
+    for (int c = 0; c < src_channels; c++)
+        in[frames * src_channels + c] = frames ? in[(frames - 1) * src_channels + c] : 0;
+    free(src);
+
+    /* Resample and remix */
+    int out_frames = (int)((int64_t)frames * rate / src_rate);
+    len = out_frames * channels * sizeof(int16_t);
+    uint8_t *out = (uint8_t *)malloc(len ? len : 1);
+    uint8_t *dst = out;
+    for (int i = 0; i < out_frames; i++)
+    {
+        int64_t pos = ((int64_t)i * src_rate << 16) / rate;
+        int j = (int)(pos >> 16), frac = (int)(pos & 0xffff) >> 1;
+        int16_t *a = in + j * src_channels, *b = a + src_channels;
+
+        for (int c = 0; c < channels; c++)
+        {
+            int sc = c < src_channels ? c : 0;
+            int v = a[sc] + (((b[sc] - a[sc]) * frac) >> 15);
+            if (channels == 1 && src_channels == 2)
+                v = (v + a[1] + (((b[1] - a[1]) * frac) >> 15)) / 2;
+            if (bigendian)
+            {
+                *dst++ = (uint8_t)(v >> 8);
+                *dst++ = (uint8_t)v;
+            }
+            else
+            {
+                *dst++ = (uint8_t)v;
+                *dst++ = (uint8_t)(v >> 8);
+            }
+        }
+    }
+    free(in);
+
+    return out;
+}
+
 static void Usage()
 {
     fprintf(stderr, "%s",
@@ -398,6 +586,9 @@ static void Usage()
         "   type <id> <type>             set entry <id> type to <type>\n"
         "   move <id1> <id2>             move entry <id1> to position <id2>\n"
         "   del <id>                     delete entry <id>\n"
+        "   sfxbank <rate> <channels> <s16|s16le|s16be> <wav>...\n"
+        "                                create a sound bank from WAV files,\n"
+        "                                converted to the mixer format\n"
         "See the abuse-tool(6) manual page for more information.\n");
 }
 
@@ -51,6 +51,9 @@ view::~view()
         free(weapons);
         free(last_weapons);
     }
+
+    delete m_bg_cache;
+    free(m_bg_cells);
 }
 
 
@@ -121,12 +124,12 @@ int32_t view::xoff()
     return Max(0, m_lastpos.x - (m_bb.x - m_aa.x + 1) / 2 + m_shift.x + pan_x);
 }
 
-int32_t view::interpolated_xoff()
+int32_t view::interpolated_xoff(int alpha)
 {
-    if (!m_focus)
-        return pan_x;
+    if (!m_focus || abs(m_lastpos.x - m_lastlastpos.x) > m_bb.x - m_aa.x)
+        return xoff();
 
-    return Max(0, (m_lastlastpos.x + m_lastpos.x) / 2
+    return Max(0, m_lastlastpos.x + (m_lastpos.x - m_lastlastpos.x) * alpha / 256
                     - (m_bb.x - m_aa.x + 1) / 2 + m_shift.x + pan_x);
 }
 
@@ -138,12 +141,12 @@ int32_t view::yoff()
     return Max(0, m_lastpos.y - (m_bb.y - m_aa.y + 1) / 2 - m_shift.y + pan_y);
 }
 
-int32_t view::interpolated_yoff()
+int32_t view::interpolated_yoff(int alpha)
 {
-    if (!m_focus)
-        return pan_y;
+    if (!m_focus || abs(m_lastpos.y - m_lastlastpos.y) > m_bb.y - m_aa.y)
+        return yoff();
 
-    return Max(0, (m_lastlastpos.y + m_lastpos.y) / 2
+    return Max(0, m_lastlastpos.y + (m_lastpos.y - m_lastlastpos.y) * alpha / 256
                     - (m_bb.y - m_aa.y + 1) / 2 - m_shift.y + pan_y);
 }
 
@@ -153,8 +156,6 @@ void view::update_scroll()
     if (!m_focus)
         return;
 
-    m_lastlastpos = m_lastpos;
-
     if (m_focus->x > m_lastpos.x)
         m_lastpos.x = Max(m_lastpos.x, m_focus->x - no_xright);
     else if (m_focus->x < m_lastpos.x)
@@ -218,6 +219,8 @@ view::view(game_object *focus, view *Next, int number)
     m_aa = ivec2(0);
     m_bb = ivec2(100);
     m_focus = focus;
+    m_bg_cache = NULL;
+    m_bg_cells = NULL;
   next=Next;
     m_shift = ivec2(SHIFT_RIGHT_DEFAULT, SHIFT_DOWN_DEFAULT);
   x_suggestion=0;
@@ -299,6 +302,29 @@ uint16_t make_sync()
   return x;
 }
 
+uint64_t make_sync_state()
+{
+  if (!current_level) return 0;
+  return current_level->sync_hash()^make_sync();
+}
+
+// SCMD_SYNC keeps the 16 bit check every tick, so that demos recorded
+// before the full object digest still play; the digest goes in its own
+// SCMD_SYNC_STATE command on the ticks it was sampled.
+void write_sync(net_packet *pk)
+{
+  pk->write_uint8(SCMD_SYNC);
+  pk->write_uint16(make_sync());
+
+  if (current_level && current_level->sync_sampled())
+  {
+    uint64_t x=make_sync_state();
+    pk->write_uint8(SCMD_SYNC_STATE);
+    pk->write_uint32((uint32_t)(x>>32));
+    pk->write_uint32((uint32_t)(x&0xffffffff));
+  }
+}
+
 
 
 void view::get_input()
@@ -783,6 +809,26 @@ void set_local_players(int total)
 }
 
 
+void view::reset_bg_cache()
+{
+    // draw_map() allocates a new one with every cell marked as empty
+    delete m_bg_cache;
+    m_bg_cache = NULL;
+}
+
+void reset_bg_caches()
+{
+  for (view *f=player_list; f; f=f->next)
+    f->reset_bg_cache();
+  if (the_game)
+  {
+    for (view *f=the_game->first_view; f; f=f->next)
+      f->reset_bg_cache();
+    for (view *f=the_game->old_view; f; f=f->next)
+      f->reset_bg_cache();
+  }
+}
+
 int total_local_players()
 {
   int t=0;
@@ -1111,6 +1157,8 @@ void view::configure_for_area(area_controller *a)
 void process_packet_commands(uint8_t *pk, int size)
 {
   int32_t sync_uint16=-1;
+  uint64_t sync_value=0;
+  int sync_got=0;
 
   if (!size) return ;
   pk[size]=SCMD_END_OF_PACKET;
@@ -1175,6 +1223,40 @@ void process_packet_commands(uint8_t *pk, int size)
       already_reloaded=1;
     }
       } break;
+
+      case SCMD_SYNC_STATE :
+      {
+    uint32_t hi,lo;
+    memcpy(&hi,pk,4);  pk+=4;
+    memcpy(&lo,pk,4);  pk+=4;
+    uint64_t x=((uint64_t)lltl(hi)<<32)|lltl(lo);
+    if (demo_man.current_state()==demo_manager::PLAYING)
+    {
+      // only compare against a sample taken on the same tick
+      if (!current_level->sync_sampled())
+        break;
+      sync_value=make_sync_state();
+      sync_got=1;
+    }
+
+    if (!sync_got)
+    {
+      sync_value=x;
+      sync_got=1;
+    }
+    else if (x!=sync_value && !already_reloaded)
+    {
+      dprintf("out of sync %d (packet=%08lx%08lx, calced=%08lx%08lx)\n",current_level->tick_counter(),
+          (unsigned long)(x>>32),(unsigned long)(x&0xffffffff),
+          (unsigned long)(sync_value>>32),(unsigned long)(sync_value&0xffffffff));
+      char name[100];
+      sprintf(name,"sync%06d.txt",(int)current_level->tick_counter());
+      current_level->write_sync_info(name);
+      if (demo_man.current_state()==demo_manager::NORMAL)
+        net_reload();
+      already_reloaded=1;
+    }
+      } break;
       case SCMD_DELETE_CLIENT :
       {
     uint8_t player_num=*(pk++);
@@ -30,6 +30,11 @@ struct suggest_struct
 
 class view;
 
+struct bg_cell          // which background tile a view's bg cache cell holds
+{
+    int32_t x, y;
+    uint16_t tile;
+};
 
 class view
 {
@@ -80,9 +85,9 @@ public:
   int32_t x_center();                        // center of attention
   int32_t y_center();
   int32_t xoff();                            // top left and right corner of the screen
-  int32_t interpolated_xoff();
+  int32_t interpolated_xoff(int alpha);      // alpha in 1/256ths of a tick
   int32_t yoff();
-  int32_t interpolated_yoff();
+  int32_t interpolated_yoff(int alpha);
   int drawable();                        // network viewables are not drawable
   int local_player();                    //  just in case I ever need non-viewable local players.
 
@@ -126,6 +131,12 @@ public:
 
     game_object *m_focus; // object we are focusing on (player)
 
+    // Background tiles around the view, laid out so that tile (x, y) sits
+    // in cell (x % columns, y % rows) and scrolling only redraws new cells
+    image *m_bg_cache;
+    bg_cell *m_bg_cells;
+    void reset_bg_cache();   // forget it, the tiles or the level changed
+
 private:
     uint8_t m_keymap[512 / 8];
     char m_chat_buf[60];
@@ -135,6 +146,7 @@ extern view *player_list;
 void set_local_players(int total);
 int total_local_players();
 void recalc_local_view_space();
+void reset_bg_caches();             // reset_bg_cache() on every view
 
 void process_packet_commands(uint8_t *pk, int size);
 
@@ -142,6 +154,8 @@ object_node *make_player_onodes(int player_num=-1);
 int total_view_vars();
 char const *get_view_var_name(int num);
 uint16_t make_sync();
+uint64_t make_sync_state();
+void write_sync(struct net_packet *pk);   // SCMD_SYNC, and SCMD_SYNC_STATE on sample ticks
 
 #endif
 